@@ -42,9 +42,12 @@
 #include "debug.h"
 #include "alloc-inl.h"
 #include "hash.h"
+#include "bitmap-inl.h"
+#include "kmeans-inl.h"
 #include "afl-fuzz.h"
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -68,6 +71,7 @@
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/file.h>
+#include <poll.h>
 
 #include <math.h>
 
@@ -145,14 +149,73 @@ static s32 out_fd,                    /* Persistent fd for out_file       */
            fsrv_ctl_fd,               /* Fork server control pipe (write) */
            fsrv_st_fd;                /* Fork server status pipe (read)   */
 
+static s32 val_forksrv_pid,           /* PID of the valuation fork server */
+           val_ctl_fd,                /* Valuation control pipe (write)   */
+           val_st_fd;                 /* Valuation status pipe (read)     */
+
+static u8  val_fsrv_failed;           /* No fork server in PACFIX_VAL_EXE */
+
+static u32 val_prev_timed_out,        /* Last valuation run timed out?    */
+           val_tmout = VAL_EXEC_TIMEOUT; /* Valuation timeout (ms)        */
+
+static u8* val_fsrv_file;             /* PACFIX_FILENAME for fork server  */
+
+/* PacFuzz: with PACFIX_VAL_WORKERS, target-reaching inputs are queued up as
+   val_jobs and valued by a pool of fork servers in the background, while
+   fuzzing goes on. */
+
+struct val_job {
+  struct queue_entry* q;              /* Seed the input came from         */
+  struct queue_entry* last;           /* Last queue entry when submitted  */
+  u8* mem;                            /* Copy of the input                */
+  u32 len;                            /* Input length                     */
+  u8  fault,                          /* Fault of the target run          */
+      crashed,                        /* Crashed at the target location?  */
+      dry_run,                        /* From the dry run?                */
+      has_log,                        /* Came with a havoc mutator log?   */
+      interesting;                    /* Selection already counted?       */
+  u32 mut_log[17],                    /* Mutators used (havoc only)       */
+      mult;                           /* Stacking multiplier              */
+};
+
+struct val_worker {
+  s32 fsrv_pid,                       /* PID of the worker's fork server  */
+      ctl_fd,                         /* Control pipe (write)             */
+      st_fd,                          /* Status pipe (read)               */
+      child_pid,                      /* PID of the running valuation     */
+      in_fd;                          /* Persistent fd for in_path        */
+  u8* in_path;                        /* Input file of the worker         */
+  u8* out_path;                       /* PACFIX_FILENAME of the worker    */
+  u8  busy,                           /* Valuing a job right now?         */
+      timed_out;                      /* Killed for running too long?     */
+  u32 prev_timed_out;                 /* Previous run timed out?          */
+  u64 deadline;                       /* When to kill the run (ms)        */
+  struct val_job job;                 /* Job being valued                 */
+};
+
+static struct val_worker* val_workers; /* Valuation workers, if up        */
+
+static struct val_job val_jobs[VAL_QUEUE_SIZE]; /* Jobs waiting for one   */
+
+static u32 val_worker_cnt,            /* PACFIX_VAL_WORKERS               */
+           val_busy,                  /* Workers with a job in progress   */
+           val_job_head,              /* Oldest waiting job               */
+           val_job_cnt;               /* Number of waiting jobs           */
+
+static u32* cur_mut_log;              /* Havoc mutators of the current    */
+static u32  cur_mut_mult;             /*   test case, for val_jobs        */
+
 static s32 forksrv_pid,               /* PID of the fork server           */
            child_pid = -1,            /* PID of the fuzzed program        */
            out_dir_fd = -1;           /* FD of the lock file              */
 
 EXP_ST u8* trace_bits;                /* SHM with code coverage bitmap    */
 EXP_ST u32* dfg_bits;                 /* SHM with DFG coverage bitmap     */
+EXP_ST u32* dfg_hdr;                  /* Header of the DFG SHM region     */
+EXP_ST u32* dfg_log;                  /* DFG nodes hit, in order of hits  */
 EXP_ST u8* target_hit;                /* SHM with target hit              */
 EXP_ST u32 dfg_target_idx;            /* Index of the target DFG node     */
+EXP_ST u32 dfg_map_size = DFG_MAP_SIZE; /* Nodes in the DFG SHM map   */
 
 EXP_ST u8  virgin_bits[MAP_SIZE],     /* Regions yet untouched by fuzzing */
            virgin_tmout[MAP_SIZE],    /* Bits we haven't seen in tmouts   */
@@ -160,9 +223,25 @@ EXP_ST u8  virgin_bits[MAP_SIZE],     /* Regions yet untouched by fuzzing */
 
 static u8  var_bytes[MAP_SIZE];       /* Bytes that appear to be variable */
 
+static const struct bitmap_kernels*
+  bitmap_kernels = &bitmap_kernels_scalar; /* Bitmap routines in use   */
+
 static s32 shm_id;                    /* ID of the SHM for code coverage  */
 static s32 shm_id_dfg;                /* ID of the SHM for DFG coverage   */
 static s32 shm_id_hit;                /* ID of the SHM for target hit     */
+static s32 shm_id_fuzz;               /* ID of the SHM for test cases     */
+
+static u32* shm_fuzz_len;             /* Test case length in SHM, if used */
+static u8*  shm_fuzz_buf;             /* Test case data in SHM, if used   */
+
+static s32  shm_id_batch;             /* ID of the SHM for batched execs  */
+static u32* batch_shm;                /* Batch region, see BATCH_MAX      */
+static u32  batch_size,               /* Test cases per batch (0 = off)   */
+            batch_cnt,                /* Test cases waiting in the batch  */
+            batch_data_len,           /* Bytes of data waiting            */
+            batch_mult[BATCH_MAX],    /* Havoc multipliers of the cases   */
+            batch_mut_log[BATCH_MAX][17]; /* Havoc mutators of the cases  */
+static u8   batch_virgin_stale = 1;   /* virgin_bits changed since sent?  */
 
 static volatile u8 stop_soon,         /* Ctrl-C pressed?                  */
                    clear_screen = 1,  /* Window resized?                  */
@@ -205,7 +284,8 @@ EXP_ST u64 total_crashes,             /* Total number of crashes          */
            bytes_trim_in,             /* Bytes coming into the trimmer    */
            bytes_trim_out,            /* Bytes coming outa the trimmer    */
            blocks_eff_total,          /* Blocks subject to effector maps  */
-           blocks_eff_select;         /* Blocks selected as fuzzable      */
+           blocks_eff_select,         /* Blocks selected as fuzzable      */
+           bench_execs;               /* Stop after that many execs       */
 
 static u32 subseq_tmouts;             /* Number of timeouts in a row      */
 
@@ -252,6 +332,33 @@ static struct queue_entry *queue,     /* Fuzzing queue (linked list)      */
 static struct queue_entry*
   first_unhandled;                    /* 1st unhandled item in the queue  */
 
+static struct queue_entry*
+  queue_skip_head[QUEUE_SKIP_LEVELS]; /* Skip list heads (0 is unused)    */
+
+static struct queue_entry*
+  queue_unhandled;                    /* Nothing unhandled comes before   */
+
+static u32 queue_skip_top;            /* Skip list levels in use          */
+static u64 queue_seq_cnt;             /* Entries inserted, for sort_seq   */
+
+static u8  seed_store_on;             /* Queue kept in the packed store?  */
+static s32 seed_store_fd = -1,        /* Packed store data file           */
+           seed_store_idx_fd = -1;    /* Packed store index file          */
+static u64 seed_store_end;            /* Bytes used in the data file      */
+static u8** seed_store_win;           /* Mapped windows of the data file  */
+static u32 seed_store_win_cnt;        /* Number of mapped windows         */
+
+static struct seed_map {
+  struct queue_entry* q;              /* Mapped entry, NULL if unused     */
+  u8* mem;                            /* Read-only mapping of its file    */
+  u32 len;                            /* Mapped length                    */
+  u64 last_use;                       /* Clock value at last use          */
+} seed_cache[SEED_CACHE_SIZE];        /* Recently fuzzed test cases       */
+
+static u64 seed_cache_clock;          /* Clock for LRU eviction           */
+
+static u8* out_arena;                 /* Spare out_buf for fuzz_one()     */
+
 static struct queue_entry*
   top_rated[MAP_SIZE];                /* Top entries for bitmap bytes     */
 
@@ -290,6 +397,31 @@ static struct vector *queue_entry_id_vec = NULL; // vector<queue_entry *>, entry
 static struct hashmap *queue_input_hash_map = NULL; // map<input_hash, queue_entry *> for queue entry
 static struct hashmap *dfg_hash_map = NULL; // map<dfg_hash, queue_entry *> for queue entry
 static struct cluster_manager *cluster_manager = NULL; // cluster manager
+static struct kmeans *cluster_model = NULL; // k-means model for cluster_manager
+static struct cluster *cluster_unassigned = NULL; // New entries until classified; last in cluster_manager
+static struct vector *cluster_pending = NULL; // vector<queue_entry *> waiting for the next batch
+static u64 cluster_flush_time = 0; // When the last batch went out (ms)
+static u8 py_clustering = 0; // Cluster with clustering.py (AFL_PY_CLUSTERING)
+static u8 cluster_online = 0; // Keep fitting on new entries (AFL_CLUSTER_ONLINE)
+static u32 cluster_rebalance_cur = 0; // Next entry ID for cluster_rebalance()
+
+/* With AFL_PY_CLUSTERING, new entries are classified by clustering.py
+   running as a server on a pair of pipes. A request is a u32 entry count
+   and a u32 vector length, then the sparse DFG vector record of each entry
+   (see dfg_vec_pack()). The reply is a (u32 entry ID, u32 cluster ID) pair
+   per entry. One request is out at a time; a batch that comes due while
+   one is out waits for the reply. */
+
+static s32 cluster_srv_pid = -1,      /* PID of clustering.py --serve     */
+           cluster_srv_fd = -1,       /* Requests (write, non-blocking)   */
+           cluster_srv_res_fd = -1;   /* Replies (read, non-blocking)     */
+
+static u32 cluster_in_flight = 0;     /* Entries in the request out       */
+static u64 cluster_sent_time;         /* When it was sent (ms)            */
+
+static u8 *cluster_req_buf;           /* Request still being written      */
+static u64 cluster_req_len,           /* Its size                         */
+           cluster_req_off;           /* Bytes of it written so far       */
 enum selection_strategy select_strategy = SELECT_DAFL; // strategy for selecting input. (dafl, random, random_cluster, dafl_cluster, default: dafl)
 static struct mut_tracker *mut_tracker_global = NULL; // global mut tracker
 static u8 use_llm=0; // Use LLM
@@ -400,6 +532,60 @@ char *sbsv_escape_square_brackets(char *original) {
 }
 
 
+/* Scratch string arena. File names and log fields that are dead once the
+   function building them returns are formatted into one static buffer
+   instead of the heap: take a mark, format away, and release the mark on
+   the way out. */
+
+static u8  scratch_buf[SCRATCH_SIZE];
+static u32 scratch_used;
+
+#define scratch_mark()      (scratch_used)
+#define scratch_release(_m) do { scratch_used = (_m); } while (0)
+
+static u8* scratch_printf(const char* fmt, ...) {
+
+  u8* ret = scratch_buf + scratch_used;
+  u32 avail = SCRATCH_SIZE - scratch_used;
+  va_list ap;
+  s32 n;
+
+  va_start(ap, fmt);
+  n = vsnprintf((char*)ret, avail, fmt, ap);
+  va_end(ap);
+
+  if (n < 0 || n >= avail) FATAL("Scratch string arena exhausted");
+
+  scratch_used += n + 1;
+  return ret;
+
+}
+
+
+/* sbsv_escape_square_brackets(), into the scratch arena. */
+
+static u8* scratch_escape_sbsv(u8* str) {
+
+  u8* ret = scratch_buf + scratch_used;
+  u32 j = 0;
+
+  for (; *str; str++) {
+
+    if (scratch_used + j + 3 > SCRATCH_SIZE)
+      FATAL("Scratch string arena exhausted");
+
+    if (*str == '[' || *str == ']') ret[j++] = '\\';
+    ret[j++] = *str;
+
+  }
+
+  ret[j] = 0;
+  scratch_used += j + 1;
+  return ret;
+
+}
+
+
 static u8 check_valid_res(u8 res) {
   return res == FAULT_CRASH || res == FAULT_NONE;
 }
@@ -853,47 +1039,99 @@ static void mark_as_redundant(struct queue_entry* q, u8 state) {
 }
 
 
+/* The queue is kept sorted by proximity score (highest first, ties in the
+   order they came in) with a skip list on top of the ->next chain, so that
+   inserting is O(log n). Level 0 is the chain itself, starting at 'queue'. */
+
+static inline struct queue_entry** queue_link(struct queue_entry* q, u32 lvl) {
+
+  if (!q) return lvl ? &queue_skip_head[lvl] : &queue;
+  return lvl ? &q->skip[lvl - 1] : &q->next;
+
+}
+
+
+/* Does a come before b in the queue? */
+
+static inline u8 queue_before(struct queue_entry* a, struct queue_entry* b) {
+
+  return a->sort_score > b->sort_score ||
+         (a->sort_score == b->sort_score && a->sort_seq < b->sort_seq);
+
+}
+
+
+/* Pick the number of skip list levels for a new entry, 1 in 4 going up a
+   level. This is derived from the insertion count rather than UR(), so as
+   not to disturb the fuzzer's random sequence. */
+
+static u32 queue_skip_level(u64 seq) {
+
+  u32 r = hash32(&seq, sizeof(seq), HASH_CONST), lvl = 1;
+
+  while (lvl < QUEUE_SKIP_LEVELS && !(r & 3)) {
+    lvl++;
+    r >>= 2;
+  }
+
+  return lvl;
+
+}
+
+
+/* Skip over the handled entries at queue_unhandled and return the first
+   unhandled one, if any. Each entry is skipped at most once per cycle. */
+
+static struct queue_entry* queue_first_unhandled(void) {
+
+  while (queue_unhandled && sched_handled(queue_unhandled))
+    queue_unhandled = queue_unhandled->next;
+
+  return queue_unhandled;
+
+}
+
+
 /* Insert a test case to the queue, preserving the sorted order based on the
  * proximity score. Updates global variables 'queue', and
  * 'first_unhandled'. */
 static void sorted_insert_to_queue(struct queue_entry* q) {
 
-  if (!queue) queue = q;
-  else {
-    struct queue_entry* q_probe;
-    u32 is_inserted = 0, i = 0;
-    first_unhandled = NULL;
+  struct queue_entry *update[QUEUE_SKIP_LEVELS], *x = NULL, *n;
+  u8 was_empty = !queue;
+  u32 lvl;
 
-    // Special case handling when we have to insert at the front.
-    if (queue->prox_score < q->prox_score) {
-      q->next = queue;
-      queue = q;
-      is_inserted = 1;
-    }
+  q->sort_score = q->prox_score;
+  q->sort_seq   = ++queue_seq_cnt;
 
-    // Traverse through the list to (1) update
-    // 'first_unhandled', and (3) insert 'q' at the proper position.
-    q_probe = queue;
-    while (q_probe) {
+  if (!q->skip_lvl) {
+    q->skip_lvl = queue_skip_level(q->sort_seq);
+    if (q->skip_lvl > 1)
+      q->skip = ck_alloc((q->skip_lvl - 1) * sizeof(struct queue_entry*));
+  }
 
-      if (!first_unhandled && !q_probe->handled_in_cycle)
-        first_unhandled = q_probe;
+  for (lvl = queue_skip_top; lvl--; ) {
 
-      if (!is_inserted) {
-        // If reached the end or found the proper position, insert there.
-        if (!q_probe->next || q_probe->next->prox_score < q->prox_score) {
-          q->next = q_probe->next;
-          q_probe->next = q;
-          is_inserted = 1;
-        }
-      }
+    while ((n = *queue_link(x, lvl)) && queue_before(n, q)) x = n;
+    update[lvl] = x;
+
+  }
 
-      q_probe = q_probe->next;
-      i++;
+  for (lvl = queue_skip_top; lvl < q->skip_lvl; lvl++) update[lvl] = NULL;
+  if (q->skip_lvl > queue_skip_top) queue_skip_top = q->skip_lvl;
+
+  for (lvl = 0; lvl < q->skip_lvl; lvl++) {
+
+    *queue_link(q, lvl) = *queue_link(update[lvl], lvl);
+    *queue_link(update[lvl], lvl) = q;
 
-    }
   }
 
+  if (!queue_unhandled || queue_before(q, queue_unhandled))
+    queue_unhandled = q;
+
+  if (!was_empty) first_unhandled = queue_first_unhandled();
+
 }
 
 /* Append new test case to the queue. */
@@ -911,6 +1149,8 @@ static void add_to_queue(u8* fname, u32 len, u8 passed_det, u64 prox_score) {
   q->entry_id     = vector_size(queue_entry_id_vec) - 1;
   q->mut_tracker  = mut_tracker_create();
 
+  sched_index_add(q);
+
   if (q->depth > max_depth) max_depth = q->depth;
 
   sorted_insert_to_queue(q);
@@ -925,436 +1165,621 @@ static void add_to_queue(u8* fname, u32 len, u8 passed_det, u64 prox_score) {
 
 }
 
-/* Sort the queue based on the proximity score. Needed after the dry-run. */
+/* Merge two sorted runs of the queue, keeping equal scores in order. */
 
-static void sort_queue(void) {
+static struct queue_entry* merge_queue(struct queue_entry* a,
+                                       struct queue_entry* b) {
 
-  struct queue_entry *q_next, *q_cur;
+  struct queue_entry *head = NULL, **tail = &head;
 
-  // First, backup 'queue'. Then, reset 'queue'
-  q_cur = queue;
-  queue = NULL;
+  while (a && b) {
 
-  while (q_cur) {
+    if (b->prox_score > a->prox_score) {
+      *tail = b;
+      b = b->next;
+    } else {
+      *tail = a;
+      a = a->next;
+    }
 
-    q_next = q_cur->next;
-    q_cur->next = NULL; // To satisfy sorted_insert_to_queue()'s assumption
-    sorted_insert_to_queue(q_cur);
-    q_cur = q_next;
+    tail = &(*tail)->next;
 
   }
 
-}
+  *tail = a ? a : b;
 
+  return head;
 
-/* Destroy the entire queue. */
+}
 
-EXP_ST void destroy_queue(void) {
 
-  struct queue_entry *q = queue, *n;
+/* Sort the queue based on the proximity score. Needed after the dry-run.
+   This is a stable merge sort of the ->next chain, after which the skip
+   list is relinked level by level in one pass. */
 
-  while (q) {
+static void sort_queue(void) {
 
-    n = q->next;
-    ck_free(q->fname);
-    ck_free(q->trace_mini);
-    ck_free(q);
-    q = n;
+  struct queue_entry *runs[64] = { 0 }, *q, *q_next;
+  struct queue_entry **tail[QUEUE_SKIP_LEVELS];
+  u32 i, lvl;
 
-  }
+  /* Bottom-up: runs[i] holds a sorted run of 2^i entries. Older runs go
+     first when merging, which keeps the sort stable. */
 
-}
+  for (q = queue; q; q = q_next) {
 
-u32 max_dfg_score() {
-  u32 max_score = 0;
-  for (u32 i = 0; i < vector_size(dfg_info_vector); i++) {
-    if (dfg_bits[i] > max_score) {
-      max_score = dfg_bits[i];
+    q_next  = q->next;
+    q->next = NULL;
+
+    for (i = 0; runs[i]; i++) {
+      q = merge_queue(runs[i], q);
+      runs[i] = NULL;
     }
-  }
-  return max_score;
-}
 
+    runs[i] = q;
 
-/* Write bitmap to file. The bitmap is useful mostly for the secret
-   -B option, to focus a separate fuzzing session on a particular
-   interesting input without rediscovering all the others. */
+  }
 
-EXP_ST void write_bitmap(void) {
+  queue = NULL;
 
-  u8* fname;
-  s32 fd;
+  for (i = 0; i < 64; i++)
+    if (runs[i]) queue = merge_queue(runs[i], queue);
 
-  if (!bitmap_changed) return;
-  bitmap_changed = 0;
+  /* Relink the upper levels and renumber the entries. */
 
-  fname = alloc_printf("%s/fuzz_bitmap", out_dir);
-  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  for (lvl = 1; lvl < QUEUE_SKIP_LEVELS; lvl++) {
+    queue_skip_head[lvl] = NULL;
+    tail[lvl] = &queue_skip_head[lvl];
+  }
 
-  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+  queue_skip_top = 1;
+  queue_seq_cnt  = 0;
 
-  ck_write(fd, virgin_bits, MAP_SIZE, fname);
+  for (q = queue; q; q = q->next) {
 
-  close(fd);
-  ck_free(fname);
+    q->sort_score = q->prox_score;
+    q->sort_seq   = ++queue_seq_cnt;
 
-}
+    for (lvl = 1; lvl < q->skip_lvl; lvl++) {
+      *tail[lvl] = q;
+      tail[lvl]  = &q->skip[lvl - 1];
+      q->skip[lvl - 1] = NULL;
+    }
 
+    if (q->skip_lvl > queue_skip_top) queue_skip_top = q->skip_lvl;
 
-/* Read bitmap from file. This is for the -B option again. */
+  }
 
-EXP_ST void read_bitmap(u8* fname) {
+  /* Like inserting the entries one by one would have left it. */
 
-  s32 fd = open(fname, O_RDONLY);
+  queue_unhandled = queue;
 
-  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+  if (queue && queue->next) first_unhandled = queue_first_unhandled();
 
-  ck_read(fd, virgin_bits, MAP_SIZE, fname);
+}
 
-  close(fd);
 
-}
+/* Destroy the entire queue. */
 
+EXP_ST void destroy_queue(void) {
 
-/* Check if the current execution path brings anything new to the table.
-   Update virgin bits to reflect the finds. Returns 1 if the only change is
-   the hit-count for a particular tuple; 2 if there are new tuples seen.
-   Updates the map, so subsequent calls will always return 0.
+  struct queue_entry *q = queue, *n;
 
-   This function is called after every exec() on a fairly large buffer, so
-   it needs to be fast. We do this in 32-bit and 64-bit flavors. */
+  while (q) {
 
-static inline u8 has_new_bits(u8* virgin_map) {
+    n = q->next;
+    ck_free(q->fname);
+    ck_free(q->trace_mini);
+    ck_free(q->skip);
+    ck_free(q);
+    q = n;
 
-#ifdef WORD_SIZE_64
+  }
 
-  u64* current = (u64*)trace_bits;
-  u64* virgin  = (u64*)virgin_map;
+}
 
-  u32  i = (MAP_SIZE >> 3);
+/* Packed seed store (AFL_SEED_STORE). Rather than one file per queue entry,
+   test cases are appended to <out_dir>/queue.pack and read back in place
+   through a read-only shared mapping. Every write also appends a record to
+   <out_dir>/queue.idx, and the newest record for an entry_id wins: a trimmed
+   entry gets a new copy instead of being rewritten. The data file is mapped
+   in SEED_STORE_WINDOW sized windows that never move, so pointers into it
+   stay valid while it grows. */
 
-#else
+struct seed_store_rec {
+  u64 off;                            /* Offset in queue.pack             */
+  u32 entry_id,                       /* Queue entry                      */
+      len,                            /* Test case length                 */
+      name_len;                       /* Length of the name that follows  */
+};
 
-  u32* current = (u32*)trace_bits;
-  u32* virgin  = (u32*)virgin_map;
 
-  u32  i = (MAP_SIZE >> 2);
+static void seed_store_init(void) {
 
-#endif /* ^WORD_SIZE_64 */
+  u8* fn = alloc_printf("%s/queue.pack", out_dir);
 
-  u8   ret = 0;
+  seed_store_fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (seed_store_fd < 0) PFATAL("Unable to create '%s'", fn);
+  ck_free(fn);
 
-  while (i--) {
+  fn = alloc_printf("%s/queue.idx", out_dir);
 
-    /* Optimize for (*current & *virgin) == 0 - i.e., no bits in current bitmap
-       that have not been already cleared from the virgin map - since this will
-       almost always be the case. */
+  seed_store_idx_fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (seed_store_idx_fd < 0) PFATAL("Unable to create '%s'", fn);
+  ck_free(fn);
 
-    if (unlikely(*current) && unlikely(*current & *virgin)) {
+}
 
-      if (likely(ret < 2)) {
 
-        u8* cur = (u8*)current;
-        u8* vir = (u8*)virgin;
+static inline u8* seed_store_ptr(struct queue_entry* q) {
 
-        /* Looks like we have not found any new bytes yet; see if any non-zero
-           bytes in current[] are pristine in virgin[]. */
+  return seed_store_win[q->store_off / SEED_STORE_WINDOW] +
+         q->store_off % SEED_STORE_WINDOW;
 
-#ifdef WORD_SIZE_64
+}
 
-        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
-            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff) ||
-            (cur[4] && vir[4] == 0xff) || (cur[5] && vir[5] == 0xff) ||
-            (cur[6] && vir[6] == 0xff) || (cur[7] && vir[7] == 0xff)) ret = 2;
-        else ret = 1;
 
-#else
+/* Append a test case to the store and point the queue entry at it. */
 
-        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
-            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff)) ret = 2;
-        else ret = 1;
+static void seed_store_put(struct queue_entry* q, u8* mem, u32 len) {
 
-#endif /* ^WORD_SIZE_64 */
+  struct seed_store_rec rec;
+  u8* name = strrchr(q->fname, '/') + 1;
+  u64 off  = seed_store_end;
+  u32 win  = off / SEED_STORE_WINDOW;
 
-      }
+  if (off % SEED_STORE_WINDOW + len > SEED_STORE_WINDOW)
+    off = (u64)++win * SEED_STORE_WINDOW;
 
-      *virgin &= ~*current;
+  while (seed_store_win_cnt <= win) {
 
-    }
+    u8* map = mmap(NULL, SEED_STORE_WINDOW, PROT_READ, MAP_SHARED,
+                   seed_store_fd, (u64)seed_store_win_cnt * SEED_STORE_WINDOW);
+
+    if (map == MAP_FAILED) PFATAL("Unable to mmap the seed store");
 
-    current++;
-    virgin++;
+    seed_store_win = ck_realloc(seed_store_win,
+                                (seed_store_win_cnt + 1) * sizeof(u8*));
+    seed_store_win[seed_store_win_cnt++] = map;
 
   }
 
-  if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
+  if (lseek(seed_store_fd, off, SEEK_SET) < 0) PFATAL("lseek() failed");
+  ck_write(seed_store_fd, mem, len, "queue.pack");
 
-  return ret;
+  rec.off      = off;
+  rec.entry_id = q->entry_id;
+  rec.len      = len;
+  rec.name_len = strlen(name);
+
+  ck_write(seed_store_idx_fd, &rec, sizeof(rec), "queue.idx");
+  ck_write(seed_store_idx_fd, name, rec.name_len, "queue.idx");
+
+  seed_store_end = off + len;
+  q->store_off   = off;
 
 }
 
 
-/* Count the number of bits set in the provided bitmap. Used for the status
-   screen several times every second, does not have to be fast. */
+/* Write every queue entry out under its classic name in <out_dir>/queue,
+   for tools that expect one file per test case. */
 
-static u32 count_bits(u8* mem) {
+static void seed_store_export(void) {
 
-  u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
-  u32  ret = 0;
+  struct queue_entry* q;
 
-  while (i--) {
+  for (q = queue; q; q = q->next) {
 
-    u32 v = *(ptr++);
+    s32 fd;
 
-    /* This gets called on the inverse, virgin bitmap; optimize for sparse
-       data. */
+    unlink(q->fname); /* ignore errors */
 
-    if (v == 0xffffffff) {
-      ret += 32;
-      continue;
-    }
+    fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) PFATAL("Unable to create '%s'", q->fname);
 
-    v -= ((v >> 1) & 0x55555555);
-    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
-    ret += (((v + (v >> 4)) & 0xF0F0F0F) * 0x01010101) >> 24;
+    ck_write(fd, seed_store_ptr(q), q->len, q->fname);
+    close(fd);
 
   }
 
-  return ret;
+  OKF("Exported %u test cases to '%s/queue'.", queued_paths, out_dir);
 
 }
 
 
-#define FF(_b)  (0xff << ((_b) << 3))
+static void seed_store_close(void) {
 
-/* Count the number of bytes set in the bitmap. Called fairly sporadically,
-   mostly to update the status screen or calibrate and examine confirmed
-   new paths. */
+  u32 i;
 
-static u32 count_bytes(u8* mem) {
+  for (i = 0; i < seed_store_win_cnt; i++)
+    munmap(seed_store_win[i], SEED_STORE_WINDOW);
 
-  u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
-  u32  ret = 0;
+  ck_free(seed_store_win);
+  close(seed_store_fd);
+  close(seed_store_idx_fd);
 
-  while (i--) {
+}
 
-    u32 v = *(ptr++);
 
-    if (!v) continue;
-    if (v & FF(0)) ret++;
-    if (v & FF(1)) ret++;
-    if (v & FF(2)) ret++;
-    if (v & FF(3)) ret++;
+/* Recently fuzzed test cases stay mapped read-only, least recently used
+   out first, so a seed that comes up again is not reopened and remapped.
+   Entries in the packed store are all mapped anyway. */
 
-  }
+static struct seed_map* seed_cache_find(struct queue_entry* q) {
 
-  return ret;
+  u32 i;
+
+  for (i = 0; i < SEED_CACHE_SIZE; i++)
+    if (seed_cache[i].q == q) return &seed_cache[i];
+
+  return NULL;
 
 }
 
 
-/* Count the number of non-255 bytes set in the bitmap. Used strictly for the
-   status screen, several calls per second or so. */
+static u8* seed_cache_get(struct queue_entry* q) {
 
-static u32 count_non_255_bytes(u8* mem) {
+  struct seed_map* m;
+  u32 i;
 
-  u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
-  u32  ret = 0;
+  if (seed_store_on) return seed_store_ptr(q);
 
-  while (i--) {
+  m = seed_cache_find(q);
 
-    u32 v = *(ptr++);
+  if (!m) {
 
-    /* This is called on the virgin bitmap, so optimize for the most likely
-       case. */
+    s32 fd;
 
-    if (v == 0xffffffff) continue;
-    if ((v & FF(0)) != FF(0)) ret++;
-    if ((v & FF(1)) != FF(1)) ret++;
-    if ((v & FF(2)) != FF(2)) ret++;
-    if ((v & FF(3)) != FF(3)) ret++;
+    m = &seed_cache[0];
 
-  }
+    for (i = 1; i < SEED_CACHE_SIZE; i++)
+      if (seed_cache[i].last_use < m->last_use) m = &seed_cache[i];
 
-  return ret;
+    if (m->q) munmap(m->mem, m->len);
 
-}
+    fd = open(q->fname, O_RDONLY);
+    if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
 
-static u64 compute_proximity_score(void) {
+    m->mem = mmap(0, q->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m->mem == MAP_FAILED) PFATAL("Unable to mmap '%s'", q->fname);
 
-  u64 prox_score = 0;
-  u32 i = DFG_MAP_SIZE;
+    close(fd);
+
+    m->q   = q;
+    m->len = q->len;
 
-  while (i--) {
-    prox_score += dfg_bits[i];
   }
 
-  return prox_score;
+  m->last_use = ++seed_cache_clock;
 
-}
+  return m->mem;
 
-/* Destructively simplify trace by eliminating hit count information
-   and replacing it with 0x80 or 0x01 depending on whether the tuple
-   is hit or not. Called on every new crash or timeout, should be
-   reasonably fast. */
+}
 
-static const u8 simplify_lookup[256] = {
 
-  [0]         = 1,
-  [1 ... 255] = 128
+/* Forget the mapping of a test case that is about to be rewritten. */
 
-};
+static void seed_cache_drop(struct queue_entry* q) {
 
-#ifdef WORD_SIZE_64
+  struct seed_map* m = seed_cache_find(q);
 
-static void simplify_trace(u64* mem) {
+  if (!m) return;
 
-  u32 i = MAP_SIZE >> 3;
+  munmap(m->mem, m->len);
 
-  while (i--) {
+  m->q        = NULL;
+  m->last_use = 0;
 
-    /* Optimize for sparse bitmaps. */
+}
 
-    if (unlikely(*mem)) {
 
-      u8* mem8 = (u8*)mem;
+/* Read the test case of a queue entry into buf (q->len bytes). */
 
-      mem8[0] = simplify_lookup[mem8[0]];
-      mem8[1] = simplify_lookup[mem8[1]];
-      mem8[2] = simplify_lookup[mem8[2]];
-      mem8[3] = simplify_lookup[mem8[3]];
-      mem8[4] = simplify_lookup[mem8[4]];
-      mem8[5] = simplify_lookup[mem8[5]];
-      mem8[6] = simplify_lookup[mem8[6]];
-      mem8[7] = simplify_lookup[mem8[7]];
+static void read_queue_entry(struct queue_entry* q, u8* buf) {
 
-    } else *mem = 0x0101010101010101ULL;
+  struct seed_map* m;
+  s32 fd;
 
-    mem++;
+  if (seed_store_on) {
+    memcpy(buf, seed_store_ptr(q), q->len);
+    return;
+  }
 
+  if ((m = seed_cache_find(q))) {
+    memcpy(buf, m->mem, q->len);
+    return;
   }
 
+  fd = open(q->fname, O_RDONLY);
+  if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
+
+  ck_read(fd, buf, q->len, q->fname);
+  close(fd);
+
 }
 
-#else
 
-static void simplify_trace(u32* mem) {
+/* Save the test case of a queue entry; q->fname must not exist yet. */
 
-  u32 i = MAP_SIZE >> 2;
+static void write_queue_entry(struct queue_entry* q, u8* mem, u32 len) {
 
-  while (i--) {
+  s32 fd;
+
+  if (seed_store_on) {
+    seed_store_put(q, mem, len);
+    return;
+  }
 
-    /* Optimize for sparse bitmaps. */
+  seed_cache_drop(q);
 
-    if (unlikely(*mem)) {
+  fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) PFATAL("Unable to create '%s'", q->fname);
 
-      u8* mem8 = (u8*)mem;
+  ck_write(fd, mem, len, q->fname);
+  close(fd);
 
-      mem8[0] = simplify_lookup[mem8[0]];
-      mem8[1] = simplify_lookup[mem8[1]];
-      mem8[2] = simplify_lookup[mem8[2]];
-      mem8[3] = simplify_lookup[mem8[3]];
+}
 
-    } else *mem = 0x01010101;
 
-    mem++;
-  }
+/* Check whether the target maintained the DFG hit log during the last run
+   and the log did not overflow. If so, the touched DFG nodes are exactly
+   those listed in dfg_log[], the running score sum and maximum in the header
+   are accurate, and the dense map need not be scanned. */
+
+static inline u8 dfg_log_valid(void) {
+
+  return dfg_hdr[DFG_HDR_MAGIC] == DFG_LOG_MAGIC &&
+         dfg_hdr[DFG_HDR_HIT_CNT] <= dfg_map_size;
 
 }
 
-#endif /* ^WORD_SIZE_64 */
+u32 max_dfg_score() {
+  u32 max_score = 0;
+  if (dfg_log_valid()) {
+    return dfg_hdr[DFG_HDR_MAX];
+  }
+  for (u32 i = 0; i < vector_size(dfg_info_vector); i++) {
+    if (dfg_bits[i] > max_score) {
+      max_score = dfg_bits[i];
+    }
+  }
+  return max_score;
+}
 
 
-/* Destructively classify execution counts in a trace. This is used as a
-   preprocessing step for any newly acquired traces. Called on every exec,
-   must be fast. */
+/* Write bitmap to file. The bitmap is useful mostly for the secret
+   -B option, to focus a separate fuzzing session on a particular
+   interesting input without rediscovering all the others. */
 
-static const u8 count_class_lookup8[256] = {
+EXP_ST void write_bitmap(void) {
 
-  [0]           = 0,
-  [1]           = 1,
-  [2]           = 2,
-  [3]           = 4,
-  [4 ... 7]     = 8,
-  [8 ... 15]    = 16,
-  [16 ... 31]   = 32,
-  [32 ... 127]  = 64,
-  [128 ... 255] = 128
+  u8* fname;
+  s32 fd;
 
-};
+  if (!bitmap_changed) return;
+  bitmap_changed = 0;
 
-static u16 count_class_lookup16[65536];
+  fname = alloc_printf("%s/fuzz_bitmap", out_dir);
+  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+
+  ck_write(fd, virgin_bits, MAP_SIZE, fname);
+
+  close(fd);
+  ck_free(fname);
+
+}
+
+
+/* Read bitmap from file. This is for the -B option again. */
+
+EXP_ST void read_bitmap(u8* fname) {
 
+  s32 fd = open(fname, O_RDONLY);
 
-EXP_ST void init_count_class16(void) {
+  if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-  u32 b1, b2;
+  ck_read(fd, virgin_bits, MAP_SIZE, fname);
 
-  for (b1 = 0; b1 < 256; b1++)
-    for (b2 = 0; b2 < 256; b2++)
-      count_class_lookup16[(b1 << 8) + b2] =
-        (count_class_lookup8[b1] << 8) |
-        count_class_lookup8[b2];
+  close(fd);
 
 }
 
 
-#ifdef WORD_SIZE_64
+/* Check if the current execution path brings anything new to the table.
+   Update virgin bits to reflect the finds. Returns 1 if the only change is
+   the hit-count for a particular tuple; 2 if there are new tuples seen.
+   Updates the map, so subsequent calls will always return 0.
+
+   This function is called after every exec() on a fairly large buffer, so
+   it needs to be fast. The actual kernels live in bitmap-inl.h. */
+
+static inline u8 has_new_bits(u8* virgin_map) {
+
+  u8 ret = bitmap_kernels->has_new_bits(trace_bits, virgin_map);
 
-static inline void classify_counts(u64* mem) {
+  if (ret && virgin_map == virgin_bits) {
+    bitmap_changed     = 1;
+    batch_virgin_stale = 1;
+  }
 
-  u32 i = MAP_SIZE >> 3;
+  return ret;
 
-  while (i--) {
+}
+
+
+/* Count the number of bits set in the provided bitmap. Used for the status
+   screen several times every second, does not have to be fast. */
+
+static u32 count_bits(u8* mem) {
 
-    /* Optimize for sparse bitmaps. */
+  u32* ptr = (u32*)mem;
+  u32  i   = (MAP_SIZE >> 2);
+  u32  ret = 0;
 
-    if (unlikely(*mem)) {
+  while (i--) {
 
-      u16* mem16 = (u16*)mem;
+    u32 v = *(ptr++);
 
-      mem16[0] = count_class_lookup16[mem16[0]];
-      mem16[1] = count_class_lookup16[mem16[1]];
-      mem16[2] = count_class_lookup16[mem16[2]];
-      mem16[3] = count_class_lookup16[mem16[3]];
+    /* This gets called on the inverse, virgin bitmap; optimize for sparse
+       data. */
 
+    if (v == 0xffffffff) {
+      ret += 32;
+      continue;
     }
 
-    mem++;
+    v -= ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    ret += (((v + (v >> 4)) & 0xF0F0F0F) * 0x01010101) >> 24;
 
   }
 
+  return ret;
+
 }
 
-#else
 
-static inline void classify_counts(u32* mem) {
+/* Count the number of bytes set in the bitmap. Called fairly sporadically,
+   mostly to update the status screen or calibrate and examine confirmed
+   new paths. */
+
+static u32 count_bytes(u8* mem) {
+
+  return bitmap_kernels->count_bytes(mem);
+
+}
+
 
-  u32 i = MAP_SIZE >> 2;
+/* Count the number of non-255 bytes set in the bitmap. Used strictly for the
+   status screen, several calls per second or so. */
+
+static u32 count_non_255_bytes(u8* mem) {
+
+  return bitmap_kernels->count_non_255_bytes(mem);
+
+}
+
+static u64 compute_proximity_score(void) {
+
+  u64 prox_score = 0;
+  u32 i;
+
+  /* The runtime keeps a running sum as nodes get hit. */
+
+  if (dfg_log_valid()) return *(u64*)(dfg_hdr + DFG_HDR_SUM);
+
+  i = dfg_map_size;
 
   while (i--) {
+    prox_score += dfg_bits[i];
+  }
+
+  return prox_score;
+
+}
+
+
+/* Fingerprint the DFG coverage of the last run. The per-node hashes are
+   combined with addition, so the result does not depend on the order in
+   which the nodes were hit, and the same coverage hashes the same whether
+   it is read from the log or from the dense map. The log of a threaded
+   target may list a node twice (see __afl_dfg_hit()), so nodes seen once
+   are skipped. Never returns 0, which marks a queue entry whose DFG hash
+   was not computed yet. */
+
+static u32 hash_dfg_bits(void) {
 
-    /* Optimize for sparse bitmaps. */
+  static u8* seen;                    /* Nodes hashed so far, one bit each */
 
-    if (unlikely(*mem)) {
+  u32 hash = 0, i, node[2];
 
-      u16* mem16 = (u16*)mem;
+  if (dfg_log_valid()) {
 
-      mem16[0] = count_class_lookup16[mem16[0]];
-      mem16[1] = count_class_lookup16[mem16[1]];
+    if (!seen) seen = ck_alloc((dfg_map_size + 7) / 8);
 
+    for (i = 0; i < dfg_hdr[DFG_HDR_HIT_CNT]; i++) {
+      node[0] = dfg_log[i];
+      if (seen[node[0] >> 3] & (1 << (node[0] & 7))) continue;
+      seen[node[0] >> 3] |= 1 << (node[0] & 7);
+      node[1] = dfg_bits[node[0]];
+      hash += hash32(node, sizeof(node), HASH_CONST);
     }
 
-    mem++;
+    for (i = 0; i < dfg_hdr[DFG_HDR_HIT_CNT]; i++)
+      seen[dfg_log[i] >> 3] = 0;
+
+  } else {
+
+    for (i = 0; i < dfg_map_size; i++) {
+      if (!dfg_bits[i]) continue;
+      node[0] = i;
+      node[1] = dfg_bits[i];
+      hash += hash32(node, sizeof(node), HASH_CONST);
+    }
 
   }
 
+  return hash ? hash : 1;
+
+}
+
+
+/* Clear the DFG coverage before a run, touching only the logged nodes when
+   possible. The magic is left alone so that we keep taking the fast path. */
+
+static inline void reset_dfg_bits(void) {
+
+  u32 i;
+
+  if (dfg_log_valid()) {
+
+    i = dfg_hdr[DFG_HDR_HIT_CNT];
+    while (i--) dfg_bits[dfg_log[i]] = 0;
+
+  } else memset(dfg_bits, 0, sizeof(u32) * dfg_map_size);
+
+  dfg_hdr[DFG_HDR_HIT_CNT] = 0;
+  dfg_hdr[DFG_HDR_MAX] = 0;
+  *(u64*)(dfg_hdr + DFG_HDR_SUM) = 0;
+
+}
+
+/* Destructively simplify trace by eliminating hit count information
+   and replacing it with 0x80 or 0x01 depending on whether the tuple
+   is hit or not. Called on every new crash or timeout, should be
+   reasonably fast. */
+
+static void simplify_trace(u8* mem) {
+
+  bitmap_kernels->simplify_trace(mem);
+
+}
+
+
+/* Destructively classify execution counts in a trace. This is used as a
+   preprocessing step for any newly acquired traces. Called on every exec,
+   must be fast. */
+
+static inline void classify_counts(u8* mem) {
+
+  bitmap_kernels->classify_counts(mem);
+
 }
 
-#endif /* ^WORD_SIZE_64 */
+
+/* Set up the lookup tables and pick the bitmap kernels for this CPU. */
+
+EXP_ST void init_bitmap_kernels(void) {
+
+  init_count_class16();
+
+  bitmap_kernels = select_bitmap_kernels();
+
+  OKF("Using %s bitmap kernels.", bitmap_kernels->name);
+
+}
 
 
 /* Get rid of shared memory (atexit handler). */
@@ -1364,6 +1789,8 @@ static void remove_shm(void) {
   shmctl(shm_id, IPC_RMID, NULL);
   shmctl(shm_id_dfg, IPC_RMID, NULL);
   shmctl(shm_id_hit, IPC_RMID, NULL);
+  if (shm_fuzz_buf) shmctl(shm_id_fuzz, IPC_RMID, NULL);
+  if (batch_shm) shmctl(shm_id_batch, IPC_RMID, NULL);
 
 }
 
@@ -1506,6 +1933,7 @@ EXP_ST void setup_shm(void) {
 
   u8* shm_str;
   u8* shm_str_dfg;
+  u8* shm_str_dfg_size;
   u8 *shm_str_hit;
 
   if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
@@ -1514,7 +1942,11 @@ EXP_ST void setup_shm(void) {
   memset(virgin_crash, 255, MAP_SIZE);
 
   shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
-  shm_id_dfg = shmget(IPC_PRIVATE, sizeof(u32) * DFG_MAP_SIZE,
+  /* Size the DFG region to the DFG we actually loaded. */
+
+  if (dfg_info_vector) dfg_map_size = vector_size(dfg_info_vector);
+
+  shm_id_dfg = shmget(IPC_PRIVATE, DFG_SHM_SIZE(dfg_map_size),
                       IPC_CREAT | IPC_EXCL | 0600);
   shm_id_hit = shmget(IPC_PRIVATE, sizeof(u8), IPC_CREAT | IPC_EXCL | 0600);
 
@@ -1524,6 +1956,7 @@ EXP_ST void setup_shm(void) {
 
   shm_str = alloc_printf("%d", shm_id);
   shm_str_dfg = alloc_printf("%d", shm_id_dfg);
+  shm_str_dfg_size = alloc_printf("%u", dfg_map_size);
   shm_str_hit = alloc_printf("%d", shm_id_hit);
 
   /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
@@ -1533,20 +1966,91 @@ EXP_ST void setup_shm(void) {
 
   if (!dumb_mode) setenv(SHM_ENV_VAR, shm_str, 1);
   if (!dumb_mode) setenv(SHM_ENV_VAR_DFG, shm_str_dfg, 1);
+  if (!dumb_mode) setenv(DFG_SIZE_ENV_VAR, shm_str_dfg_size, 1);
   if (!dumb_mode) setenv(SHM_ENV_VAR_HIT, shm_str_hit, 1);
 
   ck_free(shm_str);
   ck_free(shm_str_dfg);
+  ck_free(shm_str_dfg_size);
   ck_free(shm_str_hit);
 
   trace_bits = shmat(shm_id, NULL, 0);
-  dfg_bits = shmat(shm_id_dfg, NULL, 0);
+  dfg_hdr = shmat(shm_id_dfg, NULL, 0);
   target_hit = shmat(shm_id_hit, NULL, 0);
 
   if (trace_bits == (void *)-1) PFATAL("shmat() failed");
-  if (dfg_bits == (void *)-1) PFATAL("shmat() failed");
+  if (dfg_hdr == (void *)-1) PFATAL("shmat() failed");
   if (target_hit == (void *)-1) PFATAL("shmat() failed");
 
+  dfg_bits = dfg_hdr + DFG_HDR_SIZE;
+  dfg_log  = dfg_bits + dfg_map_size;
+
+}
+
+
+/* Set up the SHM region for handing test cases to harnesses built with
+   __AFL_FUZZ_TESTCASE(). Called once check_binary() spots the signature,
+   before the target is first started. */
+
+static void setup_shm_fuzz(void) {
+
+  u8* shm_str;
+  u8* area;
+
+  shm_id_fuzz = shmget(IPC_PRIVATE, SHM_FUZZ_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_id_fuzz < 0) PFATAL("shmget() failed");
+
+  area = shmat(shm_id_fuzz, NULL, 0);
+
+  if (area == (void *)-1) PFATAL("shmat() failed");
+
+  shm_fuzz_len = (u32*)area;
+  shm_fuzz_buf = area + sizeof(u32);
+
+  shm_str = alloc_printf("%d", shm_id_fuzz);
+  setenv(SHM_ENV_VAR_FUZZ, shm_str, 1);
+  ck_free(shm_str);
+
+}
+
+
+/* Set up the SHM region for batched execs (AFL_BATCH_SIZE). This needs a
+   persistent mode harness that takes its test cases from SHM; whether its
+   runtime plays along only becomes clear once the fork server is up. */
+
+static void setup_shm_batch(void) {
+
+  u8* shm_str;
+
+  if (!persistent_mode || !shm_fuzz_buf) {
+    WARNF("AFL_BATCH_SIZE needs a persistent mode harness that uses "
+          "__AFL_FUZZ_TESTCASE(), ignoring.");
+    batch_size = 0;
+    return;
+  }
+
+  if (post_handler || crash_mode) {
+    WARNF("AFL_BATCH_SIZE does not work with post-processors or -C, ignoring.");
+    batch_size = 0;
+    return;
+  }
+
+  shm_id_batch = shmget(IPC_PRIVATE, BATCH_SHM_SIZE,
+                        IPC_CREAT | IPC_EXCL | 0600);
+
+  if (shm_id_batch < 0) PFATAL("shmget() failed");
+
+  batch_shm = shmat(shm_id_batch, NULL, 0);
+
+  if (batch_shm == (void *)-1) PFATAL("shmat() failed");
+
+  shm_str = alloc_printf("%d", shm_id_batch);
+  setenv(SHM_ENV_VAR_BATCH, shm_str, 1);
+  ck_free(shm_str);
+
+  OKF("Running up to %u test cases per round-trip.", batch_size);
+
 }
 
 
@@ -2301,6 +2805,11 @@ EXP_ST void init_forkserver(char** argv) {
      Otherwise, try to figure out what went wrong. */
 
   if (rlen == 4) {
+
+    if (dfg_hdr[DFG_HDR_NODE_CNT] > dfg_map_size)
+      FATAL("Target was built with a DFG of %u nodes, but only %u were loaded "
+            "with -p", dfg_hdr[DFG_HDR_NODE_CNT], dfg_map_size);
+
     OKF("All right - fork server is up.");
     return;
   }
@@ -2454,8 +2963,15 @@ static u8 run_target(char** argv, u32 timeout) {
      territory. */
 
   memset(trace_bits, 0, MAP_SIZE);
-  memset(dfg_bits, 0, sizeof(u32) * DFG_MAP_SIZE);
-  memset(target_hit, 0, sizeof(u8));
+
+  /* A persistent mode target may wipe its DFG slots and the target hit flag
+     by itself between iterations; see DFG_HDR_SELF_RESET in config.h. */
+
+  if (!persistent_mode || dfg_hdr[DFG_HDR_SELF_RESET] != DFG_LOG_MAGIC) {
+    reset_dfg_bits();
+    target_hit[0] = 0;
+  }
+
   MEM_BARRIER();
 
   /* If we're running in "dumb" mode, we can't rely on the fork server
@@ -2612,11 +3128,7 @@ static u8 run_target(char** argv, u32 timeout) {
 
   tb4 = *(u32*)trace_bits;
 
-#ifdef WORD_SIZE_64
-  classify_counts((u64*)trace_bits);
-#else
-  classify_counts((u32*)trace_bits);
-#endif /* ^WORD_SIZE_64 */
+  classify_counts(trace_bits);
 
   prev_timed_out = child_timed_out;
 
@@ -2658,7 +3170,7 @@ static u8 run_target(char** argv, u32 timeout) {
    is unlinked and a new one is created. Otherwise, out_fd is rewound and
    truncated. */
 
-static void write_to_testcase(void* mem, u32 len) {
+static void write_to_file(void* mem, u32 len) {
 
   s32 fd = out_fd;
 
@@ -2684,6 +3196,27 @@ static void write_to_testcase(void* mem, u32 len) {
 }
 
 
+/* Hand a test case to the target: through SHM if the harness takes it from
+   there, through the file otherwise. Test cases never grow past MAX_FILE
+   while fuzzing, but anything that does is cut short to fit the region. */
+
+static void write_to_testcase(void* mem, u32 len) {
+
+  if (shm_fuzz_buf) {
+
+    if (len > MAX_FILE) len = MAX_FILE;
+
+    memcpy(shm_fuzz_buf, mem, len);
+    *shm_fuzz_len = len;
+    return;
+
+  }
+
+  write_to_file(mem, len);
+
+}
+
+
 /* The same, but with an adjustable gap. Used for trimming. */
 
 static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
@@ -2691,6 +3224,15 @@ static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
   s32 fd = out_fd;
   u32 tail_len = len - skip_at - skip_len;
 
+  if (shm_fuzz_buf) {
+
+    memcpy(shm_fuzz_buf, mem, skip_at);
+    memcpy(shm_fuzz_buf + skip_at, mem + skip_at + skip_len, tail_len);
+    *shm_fuzz_len = skip_at + tail_len;
+    return;
+
+  }
+
   if (out_file) {
 
     unlink(out_file); /* Ignore errors. */
@@ -2743,6 +3285,51 @@ static void link_or_copy(u8* old_path, u8* new_path) {
 
 }
 
+
+/* fuzz_one() takes its out_buf from here and gives back whichever buffer it
+   ends up with, so that one allocation serves seed after seed. */
+
+static u8* out_arena_take(u32 len) {
+
+  u8* buf = out_arena;
+
+  out_arena = NULL;
+
+  if (buf && ALLOC_S(buf) >= len) return buf;
+
+  ck_free(buf);
+  return ck_alloc_nozero(len);
+
+}
+
+
+static void out_arena_give(u8* buf) {
+
+  ck_free(out_arena);
+  out_arena = buf;
+
+}
+
+
+/* Make a copy of the test case of a queue entry at path. */
+
+static void copy_queue_entry(struct queue_entry* q, u8* path) {
+
+  s32 fd;
+
+  if (!seed_store_on) {
+    link_or_copy(q->fname, path);
+    return;
+  }
+
+  fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) PFATAL("Unable to create '%s'", path);
+
+  ck_write(fd, seed_store_ptr(q), q->len, path);
+  close(fd);
+
+}
+
 static void show_stats(void);
 
 /* Calibrate a new test case. This is done when processing the input directory
@@ -2809,7 +3396,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
     fault = run_target(argv, use_tmout);
 
     if (q->dfg_hash == 0) {
-      q->dfg_hash = hash32(dfg_bits, sizeof(u32) * DFG_MAP_SIZE, HASH_CONST);
+      q->dfg_hash = hash_dfg_bits();
       q->dfg_arr = array_create(vector_size(dfg_info_vector));
       q->dfg_max = max_dfg_score();
       array_copy(q->dfg_arr, dfg_bits, vector_size(dfg_info_vector));
@@ -2882,6 +3469,7 @@ static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
   avg_prox_score = total_prox_score / queued_paths;
   if (min_prox_score > q->prox_score) min_prox_score = q->prox_score;
   if (max_prox_score < q->prox_score) max_prox_score = q->prox_score;
+  sched_index_sync(q);
 
   update_bitmap_score(q);
 
@@ -2965,7 +3553,7 @@ static u32 hash_file(u8 *filename) {
   length = length < max_read ? length : max_read;
 
   u8 *buf = ck_alloc_nozero(length);
-  fread(buf, 1, length, file);
+  if (fread(buf, 1, length, file) != length) FATAL("Short read from '%s'", filename);
   fclose(file);
 
   u32 hash = hash32(buf, length, HASH_CONST);
@@ -2976,18 +3564,17 @@ static u32 hash_file(u8 *filename) {
 
 /* PacFuzz: save valuation function */
 
-static void save_valuation(u32 val_hash, u8 *valuation_file, u8 crashed) {
-  u8 *target_file = alloc_printf("memory/%s/id:%06llu", crashed ? "neg" : "pos",
-                                  crashed ? total_saved_crashes : total_saved_positives);
-  u8 *escaped = sbsv_escape_square_brackets(target_file);
-  LOGF("[PacFuzz] [save_valuation] [%s] [seed %d] [entry %d] [id %llu] [hash %u] [time %llu] [file %s]\n", crashed == 1 ? "neg" : "pos", queue_cur ? queue_cur->entry_id : -1, queue_last ? queue_last->entry_id : -1,
+static void save_valuation(struct queue_entry *seed, struct queue_entry *last,
+                           u32 val_hash, u8 *valuation_file, u8 crashed) {
+  u32 mark = scratch_mark();
+  u8 *target_file = scratch_printf("memory/%s/id:%06llu", crashed ? "neg" : "pos",
+                                   crashed ? total_saved_crashes : total_saved_positives);
+  u8 *escaped = scratch_escape_sbsv(target_file);
+  LOGF("[PacFuzz] [save_valuation] [%s] [seed %d] [entry %d] [id %llu] [hash %u] [time %llu] [file %s]\n", crashed == 1 ? "neg" : "pos", seed ? seed->entry_id : -1, last ? last->entry_id : -1,
        crashed ? total_saved_crashes : total_saved_positives, val_hash, get_cur_time() - start_time, escaped);
-  u8 *target_file_full = alloc_printf("%s/%s", out_dir, target_file);
+  u8 *target_file_full = scratch_printf("%s/%s", out_dir, target_file);
   rename(valuation_file, target_file_full);
-  ck_free(valuation_file);
-  ck_free(target_file);
-  ck_free(target_file_full);
-  ck_free(escaped);
+  scratch_release(mark);
   if (crashed) {
     total_saved_crashes++;
   } else {
@@ -3142,9 +3729,268 @@ static u8 run_valuation_binary(char** argv, u32 timeout, char* env_opt) {
 
 }
 
-/* PacFuzz: get valuation function */
+/* PacFuzz: the valuation binary is usually built with the same runtime as the
+   target, so it comes with a fork server of its own. Spin one up on a fresh
+   pair of pipes, with the same environment run_valuation_binary() would use
+   and PACFIX_FILENAME pointing at out_path; it is fixed from here on, so
+   every run writes to that file. Returns the PID of the fork server, or 0
+   (with everything cleaned up) if the binary doesn't answer the handshake. */
 
-static u8 run_valuation(u8 crashed, char** argv, void* mem, u32 len, u32 *val_hash, u8 **valuation_file) {
+static s32 start_val_forkserver(char** argv, u8* out_path, s32 stdin_fd,
+                                s32* ctl_fd, s32* st_fd) {
+
+  static struct itimerval it;
+  int st_pipe[2], ctl_pipe[2];
+  int status;
+  s32 rlen, pid;
+
+  u8* env_opt = alloc_printf("PACFIX_FILENAME=%s", out_path);
+
+  if (pipe(st_pipe) || pipe(ctl_pipe)) PFATAL("pipe() failed");
+
+  pid = fork();
+
+  if (pid < 0) PFATAL("[PacFuzz] [start_val_forkserver] fork() failed");
+
+  if (!pid) {
+
+    struct rlimit r;
+
+    if (!getrlimit(RLIMIT_NOFILE, &r) && r.rlim_cur < FORKSRV_FD + 2) {
+
+      r.rlim_cur = FORKSRV_FD + 2;
+      setrlimit(RLIMIT_NOFILE, &r); /* Ignore errors */
+
+    }
+
+    if (mem_limit) {
+
+      r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+
+#ifdef RLIMIT_AS
+
+      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+
+#else
+
+      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+
+#endif /* ^RLIMIT_AS */
+
+    }
+
+    r.rlim_max = r.rlim_cur = 0;
+
+    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+
+    setsid();
+
+    dup2(dev_null_fd, 1);
+    dup2(dev_null_fd, 2);
+    dup2(stdin_fd, 0);
+
+    if (stdin_fd != dev_null_fd) close(stdin_fd);
+
+    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0) PFATAL("dup2() failed");
+    if (dup2(st_pipe[1], FORKSRV_FD + 1) < 0) PFATAL("dup2() failed");
+
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
+
+    /* The main fork server's pipes must not leak into this one. */
+
+    if (fsrv_ctl_fd > 0) close(fsrv_ctl_fd);
+    if (fsrv_st_fd > 0) close(fsrv_st_fd);
+
+    close(dev_null_fd);
+    close(out_dir_fd);
+    close(dev_urandom_fd);
+    close(fileno(plot_file));
+
+    char *envp[] =
+    {
+        "ASAN_OPTIONS=abort_on_error=1:halt_on_error=1:detect_leaks=0:symbolize=0:allocator_may_return_null=1",
+        "MSAN_OPTIONS=exit_code=86:halt_on_error=1:symbolize=0:msan_track_origins=0",
+        "UBSAN_OPTIONS=halt_on_error=1:abort_on_error=1:exit_code=54:print_stacktrace=1",
+        "LD_BIND_NOW=1",
+        env_opt,
+        0
+    };
+
+    execve(argv[0], argv, envp);
+    exit(0);
+
+  }
+
+  ck_free(env_opt);
+
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
+
+  /* Other fork servers we spin up later must not hold on to our ends. */
+
+  fcntl(ctl_pipe[1], F_SETFD, FD_CLOEXEC);
+  fcntl(st_pipe[0], F_SETFD, FD_CLOEXEC);
+
+  /* Wait for the hello, but no longer than a valuation run may take. While
+     waiting, child_pid points at the fork server so that handle_timeout()
+     takes care of it. */
+
+  child_timed_out = 0;
+  child_pid = pid;
+
+  it.it_value.tv_sec = (val_tmout / 1000);
+  it.it_value.tv_usec = (val_tmout % 1000) * 1000;
+
+  setitimer(ITIMER_REAL, &it, NULL);
+
+  rlen = read(st_pipe[0], &status, 4);
+
+  it.it_value.tv_sec = 0;
+  it.it_value.tv_usec = 0;
+
+  setitimer(ITIMER_REAL, &it, NULL);
+
+  child_pid = -1;
+
+  if (rlen == 4) {
+
+    *ctl_fd = ctl_pipe[1];
+    *st_fd  = st_pipe[0];
+    return pid;
+
+  }
+
+  /* Without a fork server, the binary ran to completion on whatever was on
+     its stdin, with nobody waiting for the output. */
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+
+  close(ctl_pipe[1]);
+  close(st_pipe[0]);
+
+  unlink(out_path);
+
+  WARNF("[PacFuzz] %s has no fork server%s, falling back to execve()",
+        argv[0], child_timed_out ? " (handshake timed out)" : "");
+
+  return 0;
+
+}
+
+
+/* PacFuzz: bring up the fork server used by run_valuation(). On failure, it
+   stays off for the rest of the session. */
+
+static u8 init_val_forkserver(char** argv) {
+
+  val_forksrv_pid = start_val_forkserver(argv, val_fsrv_file,
+                                         out_file ? dev_null_fd : out_fd,
+                                         &val_ctl_fd, &val_st_fd);
+
+  if (!val_forksrv_pid) {
+
+    val_fsrv_failed = 1;
+    return 0;
+
+  }
+
+  OKF("[PacFuzz] Valuation fork server is up.");
+  return 1;
+
+}
+
+
+/* PacFuzz: run the valuation binary through its fork server. The outcome is
+   reported like run_valuation_binary() does; FAULT_ERROR means the fork server
+   went away and the caller should retry the old way. */
+
+static u8 run_valuation_fsrv(u32 timeout) {
+
+  static struct itimerval it;
+
+  int status = 0;
+
+  child_timed_out = 0;
+
+  if (write(val_ctl_fd, &val_prev_timed_out, 4) != 4 ||
+      read(val_st_fd, &child_pid, 4) != 4 || child_pid <= 0) {
+
+    if (stop_soon) return FAULT_NONE;
+    goto fsrv_gone;
+
+  }
+
+  it.it_value.tv_sec = (timeout / 1000);
+  it.it_value.tv_usec = (timeout % 1000) * 1000;
+
+  setitimer(ITIMER_REAL, &it, NULL);
+
+  if (read(val_st_fd, &status, 4) != 4) {
+
+    if (stop_soon) return FAULT_NONE;
+    goto fsrv_gone;
+
+  }
+
+  if (!WIFSTOPPED(status)) child_pid = 0;
+
+  it.it_value.tv_sec = 0;
+  it.it_value.tv_usec = 0;
+
+  setitimer(ITIMER_REAL, &it, NULL);
+
+  total_execs++;
+
+  val_prev_timed_out = child_timed_out;
+
+  if (WIFSIGNALED(status) && !stop_soon) {
+
+    kill_signal = WTERMSIG(status);
+
+    if (child_timed_out && kill_signal == SIGKILL) return FAULT_TMOUT;
+
+    return FAULT_CRASH;
+
+  }
+
+  if (uses_asan && WEXITSTATUS(status) == MSAN_ERROR) {
+    kill_signal = 0;
+    return FAULT_CRASH;
+  }
+
+  return FAULT_NONE;
+
+fsrv_gone:
+
+  it.it_value.tv_sec = 0;
+  it.it_value.tv_usec = 0;
+
+  setitimer(ITIMER_REAL, &it, NULL);
+
+  if (child_pid > 0) kill(child_pid, SIGKILL);
+  kill(val_forksrv_pid, SIGKILL);
+  waitpid(val_forksrv_pid, NULL, 0);
+
+  close(val_ctl_fd);
+  close(val_st_fd);
+
+  child_pid = -1;
+  val_forksrv_pid = 0;
+  val_fsrv_failed = 1;
+
+  WARNF("[PacFuzz] Valuation fork server died, falling back to execve()");
+
+  return FAULT_ERROR;
+
+}
+
+/* PacFuzz: get valuation function */
+
+static u8 run_valuation(u8 crashed, char** argv, void* mem, u32 len, u32 *val_hash, u8 **valuation_file) {
 
   u8 *valexe = "";
   u8 *covdir = "";
@@ -3153,65 +3999,471 @@ static u8 run_valuation(u8 crashed, char** argv, void* mem, u32 len, u32 *val_ha
   u8 fault_tmp;
   u8 *tmp_argv1 = "";
 
-  *val_hash = 0;
-  *valuation_file = NULL;
+  *val_hash = 0;
+  *valuation_file = NULL;
+
+  if(!getenv("PACFIX_VAL_EXE")) return 0;
+  if(!getenv("PACFIX_COV_DIR")) return 0;
+
+  valexe = getenv("PACFIX_VAL_EXE");
+  covdir = getenv("PACFIX_COV_DIR");
+
+  /* Both live in the scratch arena; the caller releases it once it is done
+     with *valuation_file. */
+
+  tmpfile = scratch_printf((crashed ? "%s/__valuation_file_%llu" : "%s/__valuation_file_noncrash_%llu"), covdir, (crashed ? total_saved_crashes : total_saved_positives));
+  tmpfile_env = scratch_printf("PACFIX_FILENAME=%s", tmpfile);
+
+  // Remove covdir + "/__tmp_file" (It might not exist, but that's okay)
+  chmod(tmpfile,0777);
+  remove(tmpfile);
+
+  tmp_argv1 = argv[0];
+  argv[0] = valexe;
+
+  /* Bring up the fork server before writing the test case: a binary without
+     one runs through on its own and leaves the shared stdin offset at EOF. */
+
+  if (!val_fsrv_file) {
+
+    val_fsrv_file = alloc_printf("%s/__valuation_file_cur", covdir);
+    if (!val_fsrv_failed) init_val_forkserver(argv);
+
+  }
+
+  /* The valuation binary is not a harness of ours; it always wants a file. */
+
+  write_to_file(mem, len);
+
+  fault_tmp = FAULT_ERROR;
+
+  if (!val_fsrv_failed) {
+
+    unlink(val_fsrv_file);
+    fault_tmp = run_valuation_fsrv(val_tmout);
+
+    if (fault_tmp != FAULT_ERROR && !access(val_fsrv_file, F_OK) &&
+        rename(val_fsrv_file, tmpfile))
+      PFATAL("Unable to rename '%s'", val_fsrv_file);
+
+  }
+
+  if (fault_tmp == FAULT_ERROR)
+    fault_tmp = run_valuation_binary(argv, val_tmout, tmpfile_env);
+
+  argv[0] = tmp_argv1;
+
+  // LOGF("[PacFuzz] [run_valuation] [run-completed] [fault %s] [time %llu]\n", fault_str[fault_tmp], get_cur_time() - start_time);
+
+  if (fault_tmp == FAULT_TMOUT || access(tmpfile, F_OK) != 0) {
+    return 0;
+  }
+
+  u32 hash = hash_file(tmpfile);
+
+  // Check if the hash is already in the hash table
+
+  struct key_value_pair *kvp = hashmap_get(val_hashmap, hash);
+  if (kvp != NULL) {
+    remove(tmpfile);
+    return 0;
+  }
+
+  // Add the hash to the hash table
+  hashmap_insert(val_hashmap, hash, NULL);
+
+  *valuation_file = tmpfile;
+  *val_hash = hash;
+  return 1;
+}
+
+/* PacFuzz: keep a copy of an input that produced a new valuation. */
+
+static void save_valuation_input(u8* mem, u32 len, u8 fault) {
+
+  u32 mark = scratch_mark();
+  u8* fn = scratch_printf("%s/memory/input/%s-%d", out_dir,
+                          fault == FAULT_NONE ? "pos" : "neg",
+                          hashmap_size(val_hashmap));
+  s32 fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+  ck_write(fd, mem, len, fn);
+  close(fd);
+  scratch_release(mark);
+
+}
+
+
+/* PacFuzz: argv for a valuation worker - the valuation binary, and in_path
+   wherever the target would get out_file. Returns NULL if out_file is fixed
+   (-f without @@), which would leave the workers fighting over one file. */
+
+static char** val_worker_argv(char** argv, u8* valexe, u8* in_path) {
+
+  u32 argc = 0, i, subst = 0;
+  char** ret;
+
+  while (argv[argc]) argc++;
+
+  ret = ck_alloc((argc + 1) * sizeof(char*));
+  ret[0] = valexe;
+
+  for (i = 1; i < argc; i++) {
+
+    u8* at = out_file ? (u8*)strstr(argv[i], out_file) : NULL;
+
+    if (at) {
+
+      ret[i] = alloc_printf("%.*s%s%s", (int)(at - (u8*)argv[i]), argv[i],
+                            in_path, at + strlen(out_file));
+      subst = 1;
+
+    } else ret[i] = argv[i];
+
+  }
+
+  if (out_file && !subst) {
+    ck_free(ret);
+    return NULL;
+  }
+
+  return ret;
+
+}
+
+
+/* PacFuzz: spin up the valuation workers, one fork server each. If any of
+   this doesn't work out, valuation stays synchronous. */
+
+static void init_val_workers(char** argv) {
+
+  u8* valexe = getenv("PACFIX_VAL_EXE");
+  u8* covdir = getenv("PACFIX_COV_DIR");
+  u32 i;
+
+  if (!valexe || !covdir) {
+    val_worker_cnt = 0;
+    return;
+  }
+
+  ACTF("[PacFuzz] Spinning up %u valuation workers...", val_worker_cnt);
+
+  val_workers = ck_alloc(val_worker_cnt * sizeof(struct val_worker));
+
+  for (i = 0; i < val_worker_cnt; i++) {
+
+    struct val_worker* w = &val_workers[i];
+    char** wargv;
+
+    w->in_path  = alloc_printf("%s/.val_input_%u", out_dir, i);
+    w->out_path = alloc_printf("%s/__valuation_file_cur_%u", covdir, i);
+
+    unlink(w->in_path); /* Ignore errors */
+
+    w->in_fd = open(w->in_path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (w->in_fd < 0) PFATAL("Unable to create '%s'", w->in_path);
+
+    fcntl(w->in_fd, F_SETFD, FD_CLOEXEC);
+
+    wargv = val_worker_argv(argv, valexe, w->in_path);
+
+    if (wargv) {
+
+      w->fsrv_pid = start_val_forkserver(wargv, w->out_path,
+                                         out_file ? dev_null_fd : w->in_fd,
+                                         &w->ctl_fd, &w->st_fd);
+      ck_free(wargv);
+
+      /* No point in trying again for run_valuation(). */
+
+      if (!w->fsrv_pid) val_fsrv_failed = 1;
+
+    } else WARNF("[PacFuzz] Valuation workers need @@ when using -f");
+
+    if (!w->fsrv_pid) {
+
+      /* Tear down whatever we got so far. */
+
+      while (1) {
+
+        if (w->fsrv_pid) {
+          kill(w->fsrv_pid, SIGKILL);
+          waitpid(w->fsrv_pid, NULL, 0);
+          close(w->ctl_fd);
+          close(w->st_fd);
+        }
+
+        close(w->in_fd);
+        unlink(w->in_path);
+        ck_free(w->in_path);
+        ck_free(w->out_path);
+
+        if (w == val_workers) break;
+        w--;
+
+      }
+
+      ck_free(val_workers);
+      val_workers = NULL;
+      val_worker_cnt = 0;
+
+      WARNF("[PacFuzz] Valuation will be done synchronously.");
+      return;
+
+    }
+
+  }
+
+  OKF("[PacFuzz] Valuation workers are up.");
+
+}
+
+
+/* PacFuzz: hand queued jobs over to idle workers. */
+
+static void val_pool_dispatch(void) {
+
+  u32 i;
+
+  for (i = 0; i < val_worker_cnt && val_job_cnt; i++) {
+
+    struct val_worker* w = &val_workers[i];
+
+    if (w->busy) continue;
+
+    w->job = val_jobs[val_job_head];
+    val_job_head = (val_job_head + 1) % VAL_QUEUE_SIZE;
+    val_job_cnt--;
+
+    lseek(w->in_fd, 0, SEEK_SET);
+    ck_write(w->in_fd, w->job.mem, w->job.len, w->in_path);
+    if (ftruncate(w->in_fd, w->job.len)) PFATAL("ftruncate() failed");
+    lseek(w->in_fd, 0, SEEK_SET);
+
+    unlink(w->out_path); /* Ignore errors */
+
+    if (write(w->ctl_fd, &w->prev_timed_out, 4) != 4 ||
+        read(w->st_fd, &w->child_pid, 4) != 4 || w->child_pid <= 0) {
+
+      if (stop_soon) return;
+      FATAL("Unable to request new process from valuation worker (OOM?)");
+
+    }
+
+    w->busy      = 1;
+    w->timed_out = 0;
+    w->deadline  = get_cur_time() + val_tmout;
+
+    val_busy++;
+
+  }
+
+}
+
+
+/* PacFuzz: a worker is done; merge the result like run_valuation() and
+   get_valuation() would have, and credit the seed the input came from. */
+
+static void val_worker_done(struct val_worker* w, s32 status) {
+
+  struct val_job* job = &w->job;
+  struct queue_entry* q = job->q;
+  u32 hash;
+
+  if (!WIFSTOPPED(status)) w->child_pid = 0;
+
+  w->busy = 0;
+  w->prev_timed_out = w->timed_out;
+  val_busy--;
+  total_execs++;
+
+  if ((w->timed_out && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL) ||
+      access(w->out_path, F_OK)) goto done;
+
+  hash = hash_file(w->out_path);
+
+  if (hashmap_get(val_hashmap, hash)) {
+    unlink(w->out_path);
+    goto done;
+  }
+
+  hashmap_insert(val_hashmap, hash, NULL);
+
+  save_valuation(q, job->last, hash, w->out_path, job->crashed);
+  save_valuation_input(job->mem, job->len, job->fault);
+
+  if (job->dry_run) {
+
+    mut_tracker_update_num(mut_tracker_global, 1);
+    mut_tracker_update_num(q->mut_tracker, 1);
+    mut_tracker_update_queue(q->mut_tracker);
+
+  } else if (job->has_log && !job->interesting) {
+
+    /* If log_mutator() already counted the selection as interesting (new
+       DFG max), crediting it again would count it twice. */
+
+    mut_tracker_credit(mut_tracker_global, job->mut_log, job->mult);
+    mut_tracker_credit(q->mut_tracker, job->mut_log, job->mult);
+
+  }
+
+  sched_index_sync(q);
+
+  LOGF("[PacFuzz] [val_worker_done] [seed %d] [inter %llu] [total %llu] [time %llu]\n", q->entry_id, mut_tracker_global->inter_num, mut_tracker_global->total_num, get_cur_time() - start_time);
+
+done:
+
+  ck_free(job->mem);
+  job->mem = NULL;
+
+}
+
+
+/* PacFuzz: collect finished valuations, kill overdue ones, and keep the
+   workers fed. With wait_ms < 0, wait until at least one worker is done. */
+
+static void val_pool_reap(s32 wait_ms) {
+
+  struct pollfd pfd[VAL_WORKERS_MAX];
+  struct val_worker* pw[VAL_WORKERS_MAX];
+  u64 now = get_cur_time(), next = now + val_tmout;
+  u32 i, n = 0;
+  s32 status;
+
+  for (i = 0; i < val_worker_cnt; i++) {
+
+    struct val_worker* w = &val_workers[i];
+
+    if (!w->busy) continue;
+
+    if (now >= w->deadline && !w->timed_out) {
+      w->timed_out = 1;
+      kill(w->child_pid, SIGKILL);
+    }
+
+    if (w->deadline < next) next = w->deadline;
+
+    pfd[n].fd     = w->st_fd;
+    pfd[n].events = POLLIN;
+    pw[n++]       = w;
+
+  }
+
+  if (n) {
+
+    if (wait_ms < 0) wait_ms = next > now ? next - now : 0;
+
+    if (poll(pfd, n, wait_ms) < 0) {
+
+      if (errno != EINTR) PFATAL("poll() failed");
+      n = 0;
+
+    }
+
+    for (i = 0; i < n; i++) {
+
+      if (!pfd[i].revents) continue;
+
+      if (read(pw[i]->st_fd, &status, 4) != 4) {
+
+        if (stop_soon) return;
+        FATAL("Valuation worker is misbehaving (OOM?)");
+
+      }
 
-  if(!getenv("PACFIX_VAL_EXE")) return 0;
-  if(!getenv("PACFIX_COV_DIR")) return 0;
+      val_worker_done(pw[i], status);
 
-  valexe = getenv("PACFIX_VAL_EXE");
-  covdir = getenv("PACFIX_COV_DIR");
+    }
 
-  tmpfile = alloc_printf((crashed ? "%s/__valuation_file_%llu" : "%s/__valuation_file_noncrash_%llu"), covdir, (crashed ? total_saved_crashes : total_saved_positives));
-  tmpfile_env = alloc_printf("PACFIX_FILENAME=%s", tmpfile);
+  }
 
-  // Remove covdir + "/__tmp_file" (It might not exist, but that's okay)
-  chmod(tmpfile,0777);
-  remove(tmpfile);
+  val_pool_dispatch();
 
-  write_to_testcase(mem, len);
+}
 
-  tmp_argv1 = argv[0];
-  argv[0] = valexe;
-  fault_tmp = run_valuation_binary(argv, 10000, tmpfile_env);
-  argv[0] = tmp_argv1;
-  ck_free(tmpfile_env);
 
-  // LOGF("[PacFuzz] [run_valuation] [run-completed] [fault %s] [time %llu]\n", fault_str[fault_tmp], get_cur_time() - start_time);
+/* PacFuzz: queue up an input for the valuation workers, waiting for a free
+   slot if there is none. */
 
-  if (fault_tmp == FAULT_TMOUT || access(tmpfile, F_OK) != 0) {
-    ck_free(tmpfile);
-    return 0;
-  }
+static void val_pool_submit(struct queue_entry* q, u8* mem, u32 len,
+                            u8 fault, u8 crashed, u8 dry_run) {
 
-  u32 hash = hash_file(tmpfile);
+  struct val_job* job;
 
-  // Check if the hash is already in the hash table
+  while (val_job_cnt == VAL_QUEUE_SIZE && !stop_soon) val_pool_reap(-1);
 
-  struct key_value_pair *kvp = hashmap_get(val_hashmap, hash);
-  if (kvp != NULL) {
-    remove(tmpfile);
-    ck_free(tmpfile);
-    return 0;
-  }
+  if (stop_soon) return;
 
-  // Add the hash to the hash table
-  hashmap_insert(val_hashmap, hash, NULL);
+  job = &val_jobs[(val_job_head + val_job_cnt) % VAL_QUEUE_SIZE];
+
+  job->q       = q;
+  job->last    = queue_last;
+  job->mem     = ck_alloc_nozero(len);
+  job->len     = len;
+  job->fault   = fault;
+  job->crashed = crashed;
+  job->dry_run = dry_run;
+  job->has_log = !!cur_mut_log;
+  job->interesting = is_interesting;
+  job->mult    = cur_mut_mult;
+
+  memcpy(job->mem, mem, len);
+  if (cur_mut_log) memcpy(job->mut_log, cur_mut_log, sizeof(job->mut_log));
+
+  val_job_cnt++;
+
+  val_pool_dispatch();
+
+}
+
+
+/* PacFuzz: wait for all queued and running valuations to finish. */
+
+static void val_pool_drain(void) {
+
+  while ((val_busy || val_job_cnt) && !stop_soon) val_pool_reap(-1);
+
+}
+
+
+/* PacFuzz: kill all workers and their fork servers. Safe to call from the
+   signal handler. */
+
+static void val_pool_kill(void) {
+
+  u32 i;
+
+  for (i = 0; i < val_worker_cnt; i++) {
+
+    if (val_workers[i].child_pid > 0) kill(val_workers[i].child_pid, SIGKILL);
+    if (val_workers[i].fsrv_pid > 0) kill(val_workers[i].fsrv_pid, SIGKILL);
+
+  }
 
-  *valuation_file = tmpfile;
-  *val_hash = hash;
-  return 1;
 }
 
-static u8 get_valuation(char** argv, u8* use_mem, u32 len, u8 crashed) {
+
+static u8 get_valuation(char** argv, struct queue_entry* q, u8* use_mem,
+                        u32 len, u8 fault, u8 dry_run) {
+  u8 crashed = is_crashed_at_target_loc();
   // Check current run is covering target line
   if (check_target_covered()) {
-    u32 val_hash;
+    // Hand it over to the workers, if we have them; results come in later
+    if (val_worker_cnt && !val_workers) init_val_workers(argv);
+    if (val_worker_cnt) {
+      val_pool_submit(q, use_mem, len, fault, crashed, dry_run);
+      return 0;
+    }
+
+    u32 val_hash, mark = scratch_mark();
     u8 *valuation_file;
     u8 success = run_valuation(1, argv, use_mem, len, &val_hash, &valuation_file);
     if (success) {
-      save_valuation(val_hash, valuation_file, crashed);
+      save_valuation(q, queue_last, val_hash, valuation_file, crashed);
     }
+    scratch_release(mark);
 
     return success;
   }
@@ -3249,23 +4501,72 @@ static char *trace_print(u8 *trace_local) {
   return str;
 }
 
+/* Sparse DFG vector record of q: its u32 input hash, u32 entry ID and the
+   u32 number of non-zero counters, then a packed (u32 index, u64 value)
+   pair for each of those. This is the format of out_dir/dfg_vectors.bin
+   and of requests to the clustering server. Returns the size of the
+   record; with buf NULL, that is all it does. */
+
+static u32 dfg_vec_pack(struct queue_entry *q, u8 *buf) {
+
+  u32 hdr[3] = { q->input_hash, q->entry_id, 0 };
+  u32 n = q->dfg_arr ? q->dfg_arr->size : 0, off = sizeof(hdr), i;
+
+  for (i = 0; i < n; i++) {
+
+    u64 v = q->dfg_arr->data[i];
+
+    if (!v) continue;
+
+    if (buf) {
+      memcpy(buf + off, &i, sizeof(u32));
+      memcpy(buf + off + sizeof(u32), &v, sizeof(u64));
+    }
+
+    off += sizeof(u32) + sizeof(u64);
+    hdr[2]++;
+
+  }
+
+  if (buf) memcpy(buf, hdr, sizeof(hdr));
+
+  return off;
+
+}
+
+static void save_dfg_vector(FILE *vec_file, struct queue_entry *q) {
+
+  u32 len = dfg_vec_pack(q, NULL);
+  u8 *buf = ck_alloc_nozero(len);
+
+  dfg_vec_pack(q, buf);
+  if (fwrite(buf, len, 1, vec_file) != 1) PFATAL("Short write to dfg_vectors.bin");
+  ck_free(buf);
+
+}
+
+/* Log the dry run of q and, if save_file is open (AFL_DRY_RUN_SBSV), add
+   it to dry_run_results.sbsv with its full DFG vector and trace. */
+
 static void save_dry_run(FILE *save_file, struct queue_entry *q, u64 exec_len, u8 res) {
 
   char *fn = q->fname;
   char *escaped = sbsv_escape_square_brackets(fn);
   u32 hash = q->input_hash;
   u32 dfg_hash = q->dfg_hash;
-  char *vec_str = array_print(q->dfg_arr);
   u8 target = check_target_covered();
-  u8 *trace_bits_local = ck_alloc_nozero(MAP_SIZE);
-  memcpy(trace_bits_local, trace_bits, MAP_SIZE);
-  simplify_trace(trace_bits_local);
-  char *trace_str = trace_print(trace_bits_local);
-  fprintf(save_file, "[seed] [file %s] [hash %u] [dfg %u] [res %d] [time %llu] [target %d] [vec %s] [trace %s]\n", escaped, hash, dfg_hash, res, exec_len, target, vec_str, trace_str);
-  LOGF("[save_dry_run] [file %s] [hash %u] [dfg %u] [res %d] [exec-time %llu] [time %llu] [target %d] [vec %s]\n", escaped, hash, dfg_hash, res, exec_len, get_cur_time() - start_time, target, vec_str);
-  ck_free(vec_str);
-  ck_free(trace_str);
-  ck_free(trace_bits_local);
+  if (save_file) {
+    char *vec_str = array_print(q->dfg_arr);
+    u8 *trace_bits_local = ck_alloc_nozero(MAP_SIZE);
+    memcpy(trace_bits_local, trace_bits, MAP_SIZE);
+    simplify_trace(trace_bits_local);
+    char *trace_str = trace_print(trace_bits_local);
+    fprintf(save_file, "[seed] [file %s] [hash %u] [dfg %u] [res %d] [time %llu] [target %d] [vec %s] [trace %s]\n", escaped, hash, dfg_hash, res, exec_len, target, vec_str, trace_str);
+    ck_free(trace_str);
+    ck_free(trace_bits_local);
+    ck_free(vec_str);
+  }
+  LOGF("[save_dry_run] [file %s] [hash %u] [dfg %u] [res %d] [exec-time %llu] [time %llu] [target %d]\n", escaped, hash, dfg_hash, res, exec_len, get_cur_time() - start_time, target);
   ck_free(escaped);
 
 }
@@ -3276,42 +4577,27 @@ static void perform_dry_run_single(char** argv, struct queue_entry *q) {
 
   u8* use_mem;
   u8  res;
-  s32 fd;
 
   u8 *fn = strrchr(q->fname, '/') + 1;
 
   ACTF("Attempting dry run with '%s'...", fn);
 
-  fd = open(q->fname, O_RDONLY);
-  if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
-
-  use_mem = ck_alloc_nozero(q->len);
-
-  if (read(fd, use_mem, q->len) != q->len)
-    FATAL("Short read from '%s'", q->fname);
-
-  close(fd);
+  use_mem = seed_cache_get(q);
 
   res = calibrate_case(argv, q, use_mem, 0, 1);
   u8 *fn_escaped = sbsv_escape_square_brackets(fn);
   LOGF("[dry-run] [entry %d] [file %s] [hash %u] [dfg %u] [res %d] [prox %lld] [pre %lld]\n", q->entry_id, fn_escaped, q->input_hash, q->dfg_hash, res, compute_proximity_score(), q->prox_score);
   ck_free(fn_escaped);
 
-  u8 has_unique_memval = get_valuation(argv, use_mem, q->len, is_crashed_at_target_loc());
+  u8 has_unique_memval = get_valuation(argv, q, use_mem, q->len, res, 1);
   if (has_unique_memval) {
     mut_tracker_update_num(mut_tracker_global, 1);
     mut_tracker_update_num(q->mut_tracker, 1);
     mut_tracker_update_queue(q->mut_tracker);
-    fn = alloc_printf("%s/memory/input/%s-%d", out_dir, res == FAULT_NONE ? "pos" : "neg", hashmap_size(val_hashmap));
-    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0) PFATAL("Unable to create '%s'", fn);
-    ck_write(fd, use_mem, q->len, fn);
-    close(fd);
-    ck_free(fn);
+    sched_index_sync(q);
+    save_valuation_input(use_mem, q->len, res);
   }
 
-  ck_free(use_mem);
-
   if (stop_soon) return;
 
   if (res == crash_mode || res == FAULT_NOBITS)
@@ -3368,8 +4654,21 @@ static void perform_dry_run(char** argv) {
   struct queue_entry* q = queue;
   u32 cal_failures = 0;
   u8* skip_crashes = getenv("AFL_SKIP_CRASHES");
-  u8* save_filename = alloc_printf("%s/dry_run_results.sbsv", out_dir);
-  FILE *save_file = fopen(save_filename, "w");
+  u8* vec_filename = alloc_printf("%s/dfg_vectors.bin", out_dir);
+  FILE *vec_file = fopen(vec_filename, "w");
+  u32 vec_hdr[2] = { DFG_VEC_MAGIC, vector_size(dfg_info_vector) };
+  u8* save_filename = NULL;
+  FILE *save_file = NULL;
+
+  if (!vec_file) PFATAL("Unable to create '%s'", vec_filename);
+  if (fwrite(vec_hdr, sizeof(vec_hdr), 1, vec_file) != 1)
+    PFATAL("Short write to '%s'", vec_filename);
+
+  if (getenv("AFL_DRY_RUN_SBSV")) {
+    save_filename = alloc_printf("%s/dry_run_results.sbsv", out_dir);
+    save_file = fopen(save_filename, "w");
+    if (!save_file) PFATAL("Unable to create '%s'", save_filename);
+  }
 
   while (q) {
 
@@ -3381,21 +4680,14 @@ static void perform_dry_run(char** argv) {
 
     ACTF("Attempting dry run with '%s'...", fn);
 
-    fd = open(q->fname, O_RDONLY);
-    if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
-
-    use_mem = ck_alloc_nozero(q->len);
-
-    if (read(fd, use_mem, q->len) != q->len)
-      FATAL("Short read from '%s'", q->fname);
-
-    close(fd);
+    use_mem = seed_cache_get(q);
 
     res = calibrate_case(argv, q, use_mem, 0, 1);
     u8 *fn_escaped = sbsv_escape_square_brackets(fn);
     LOGF("[dry-run] [entry %d] [file %s] [hash %u] [dfg %u] [res %d] [prox %lld] [pre %lld]\n", q->entry_id, fn_escaped, q->input_hash, q->dfg_hash, res, compute_proximity_score(), q->prox_score);
     ck_free(fn_escaped);
 
+    save_dfg_vector(vec_file, q);
     save_dry_run(save_file, q, q->exec_us, res);
     if (ignore_valuation) {
       if (check_target_covered()) {
@@ -3406,22 +4698,16 @@ static void perform_dry_run(char** argv) {
         ck_free(filename);
       }
     } else {
-      u8 has_unique_memval = get_valuation(argv, use_mem, q->len, is_crashed_at_target_loc());
+      u8 has_unique_memval = get_valuation(argv, q, use_mem, q->len, res, 1);
       if (has_unique_memval) {
         mut_tracker_update_num(mut_tracker_global, 1);
         mut_tracker_update_num(q->mut_tracker, 1);
         mut_tracker_update_queue(q->mut_tracker);
-        fn = alloc_printf("%s/memory/input/%s-%d", out_dir, res == FAULT_NONE ? "pos" : "neg", hashmap_size(val_hashmap));
-        fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-        if (fd < 0) PFATAL("Unable to create '%s'", fn);
-        ck_write(fd, use_mem, q->len, fn);
-        close(fd);
-        ck_free(fn);
+        sched_index_sync(q);
+        save_valuation_input(use_mem, q->len, res);
       }  
     }
 
-    ck_free(use_mem);
-
     if (stop_soon) return;
 
     if (res == crash_mode || res == FAULT_NOBITS)
@@ -3575,8 +4861,18 @@ static void perform_dry_run(char** argv) {
 
   }
 
-  fclose(save_file);
-  ck_free(save_filename);
+  fclose(vec_file);
+  ck_free(vec_filename);
+
+  if (save_file) {
+    fclose(save_file);
+    ck_free(save_filename);
+  }
+
+  /* Valuations of the initial inputs count toward the seeds they came from,
+     so have them all in before we start picking seeds. */
+
+  val_pool_drain();
 
   if (cal_failures) {
 
@@ -3674,9 +4970,28 @@ static void pivot_inputs(void) {
 
     /* Pivot to the new queue entry. */
 
-    link_or_copy(q->fname, nfn);
-    ck_free(q->fname);
-    q->fname = nfn;
+    if (seed_store_on) {
+
+      u8* mem = ck_alloc_nozero(q->len);
+      s32 fd = open(q->fname, O_RDONLY);
+
+      if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
+      ck_read(fd, mem, q->len, q->fname);
+      close(fd);
+
+      ck_free(q->fname);
+      q->fname = nfn;
+
+      seed_store_put(q, mem, q->len);
+      ck_free(mem);
+
+    } else {
+
+      link_or_copy(q->fname, nfn);
+      ck_free(q->fname);
+      q->fname = nfn;
+
+    }
 
     /* Make sure that the passed_det value carries over, too. */
 
@@ -3712,104 +5027,329 @@ static u8* describe_op(u8 hnb) {
     if (splicing_with >= 0)
       sprintf(ret + strlen(ret), "+%06u", splicing_with);
 
-    sprintf(ret + strlen(ret), ",op:%s", stage_short);
+    sprintf(ret + strlen(ret), ",op:%s", stage_short);
+
+    if (stage_cur_byte >= 0) {
+
+      sprintf(ret + strlen(ret), ",pos:%u", stage_cur_byte);
+
+      if (stage_val_type != STAGE_VAL_NONE)
+        sprintf(ret + strlen(ret), ",val:%s%+d",
+                (stage_val_type == STAGE_VAL_BE) ? "be:" : "",
+                stage_cur_val);
+
+    } else sprintf(ret + strlen(ret), ",rep:%u", stage_cur_val);
+
+  }
+
+  if (hnb == 2) strcat(ret, ",+cov");
+
+  return ret;
+
+}
+
+#endif /* !SIMPLE_FILES */
+
+
+/* Write a message accompanying the crash directory :-) */
+
+static void write_crash_readme(void) {
+
+  u8* fn = alloc_printf("%s/crashes/README.txt", out_dir);
+  s32 fd;
+  FILE* f;
+
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  ck_free(fn);
+
+  /* Do not die on errors here - that would be impolite. */
+
+  if (fd < 0) return;
+
+  f = fdopen(fd, "w");
+
+  if (!f) {
+    close(fd);
+    return;
+  }
+
+  fprintf(f, "Command line used to find this crash:\n\n"
+
+             "%s\n\n"
+
+             "If you can't reproduce a bug outside of afl-fuzz, be sure to set the same\n"
+             "memory limit. The limit used for this fuzzing session was %s.\n\n"
+
+             "Need a tool to minimize test cases before investigating the crashes or sending\n"
+             "them to a vendor? Check out the afl-tmin that comes with the fuzzer!\n\n"
+
+             "Found any cool bugs in open-source tools using afl-fuzz? If yes, please drop\n"
+             "me a mail at <lcamtuf@coredump.cx> once the issues are fixed - I'd love to\n"
+             "add your finds to the gallery at:\n\n"
+
+             "  http://lcamtuf.coredump.cx/afl/\n\n"
+
+             "Thanks :-)\n",
+
+             orig_cmdline, DMS(mem_limit << 20)); /* ignore errors */
+
+  fclose(f);
+
+}
+
+/* Move a new queue entry into the cluster with the nearest centroid. */
+
+static void assign_cluster(struct queue_entry *q, u32 cluster_id, u64 clustering_start_time) {
+
+  cluster_remove_child(cluster_unassigned, q);
+  cluster_add_child(cluster_manager_get_cluster(cluster_manager, cluster_id), q);
+  LOGF("[cluster] [seed %d] [cluster %d] [elapsed %llu] [time %llu]\n", q->entry_id, cluster_id, get_cur_time() - clustering_start_time, get_cur_time() - start_time);
+
+}
+
+/* With AFL_CLUSTER_ONLINE, the centroids keep moving, so entries that were
+   closest to one centroid when placed may now be closer to another. Look
+   at the next CLUSTER_REBALANCE_STEP entries, round-robin over the whole
+   queue, and move those that are in the wrong cluster. */
+
+static void cluster_rebalance(void) {
+
+  u32 n = vector_size(queue_entry_id_vec), i;
+
+  for (i = 0; i < CLUSTER_REBALANCE_STEP && i < n; i++) {
+
+    struct queue_entry *q;
+    u32 cluster_id;
+
+    if (cluster_rebalance_cur >= n) cluster_rebalance_cur = 0;
+    q = vector_get(queue_entry_id_vec, cluster_rebalance_cur++);
+
+    if (!q || !q->dfg_arr || !q->cluster || q->cluster == cluster_unassigned)
+      continue;
+
+    cluster_id = kmeans_predict(cluster_model, q->dfg_arr->data);
+    if (cluster_id == q->cluster->id) continue;
+
+    LOGF("[recluster] [seed %d] [from %d] [to %d] [time %llu]\n", q->entry_id, q->cluster->id, cluster_id, get_cur_time() - start_time);
+    cluster_remove_child(q->cluster, q);
+    cluster_add_child(cluster_manager_get_cluster(cluster_manager, cluster_id), q);
+
+  }
+
+}
+
+/* Start clustering.py as a server for the model that init_clusters() had
+   it fit and pickle. */
+
+static void cluster_srv_start(void) {
+
+  char *cludafl_dir = getenv("CLUDAFL");
+  s32 req_pipe[2], res_pipe[2];
+
+  if (pipe(req_pipe) || pipe(res_pipe)) PFATAL("pipe() failed");
+
+  cluster_srv_pid = fork();
+  if (cluster_srv_pid < 0) PFATAL("fork() failed");
+
+  if (!cluster_srv_pid) {
+
+    u8 *script = alloc_printf("%s/clustering.py", cludafl_dir);
+
+    /* Leave Ctrl+C to us; the server quits when its stdin is closed. */
+
+    signal(SIGINT, SIG_IGN);
+
+    dup2(req_pipe[0], 0);
+    dup2(res_pipe[1], 1);
+
+    close(req_pipe[0]);
+    close(req_pipe[1]);
+    close(res_pipe[0]);
+    close(res_pipe[1]);
+
+    execlp("python3", "python3", script, "--serve", "-", "kmeans", out_dir,
+           (char *)NULL);
+
+    PFATAL("Unable to execute python3");
+
+  }
+
+  close(req_pipe[0]);
+  close(res_pipe[1]);
+
+  cluster_srv_fd = req_pipe[1];
+  cluster_srv_res_fd = res_pipe[0];
+
+  fcntl(cluster_srv_fd, F_SETFL, O_NONBLOCK);
+  fcntl(cluster_srv_res_fd, F_SETFL, O_NONBLOCK);
+
+}
+
+/* Write as much of the current request as the pipe takes right now; the
+   rest goes out from later cluster_srv_poll() calls. The server may still
+   be starting up, or busy reading, so this never waits for it. */
+
+static void cluster_srv_write(void) {
+
+  while (cluster_req_off < cluster_req_len) {
+
+    s32 w = write(cluster_srv_fd, cluster_req_buf + cluster_req_off,
+                  cluster_req_len - cluster_req_off);
+
+    if (w < 0 && (errno == EAGAIN || errno == EINTR)) return;
+
+    if (w <= 0) {
+      if (stop_soon) return;
+      FATAL("Clustering server has gone away");
+    }
+
+    cluster_req_off += w;
+
+  }
+
+  ck_free(cluster_req_buf);
+  cluster_req_buf = NULL;
+
+}
+
+/* Send all pending entries in one request, unless one is still out. */
+
+static void cluster_srv_send(void) {
+
+  u32 n = vector_size(cluster_pending), dim = vector_size(dfg_info_vector);
+  u32 hdr[2] = { n, dim }, i;
+  u64 size = sizeof(hdr);
+  u8 *buf, *p;
+
+  if (!n || cluster_in_flight) return;
+
+  for (i = 0; i < n; i++)
+    size += dfg_vec_pack(vector_get(cluster_pending, i), NULL);
+
+  buf = p = ck_alloc_nozero(size);
+
+  memcpy(p, hdr, sizeof(hdr));
+  p += sizeof(hdr);
+
+  for (i = 0; i < n; i++)
+    p += dfg_vec_pack(vector_get(cluster_pending, i), p);
+
+  cluster_req_buf = buf;
+  cluster_req_len = size;
+  cluster_req_off = 0;
+
+  cluster_in_flight = n;
+  cluster_sent_time = get_cur_time();
+  vector_clear(cluster_pending);
+
+  cluster_srv_write();
+
+}
+
+/* Push out more of a partly written request, and move entries whose
+   assignments have come back into their clusters. Never waits for the
+   server. */
 
-    if (stage_cur_byte >= 0) {
+static void cluster_srv_poll(void) {
 
-      sprintf(ret + strlen(ret), ",pos:%u", stage_cur_byte);
+  static u8 res_buf[4096];
+  static u32 res_len;
 
-      if (stage_val_type != STAGE_VAL_NONE)
-        sprintf(ret + strlen(ret), ",val:%s%+d",
-                (stage_val_type == STAGE_VAL_BE) ? "be:" : "",
-                stage_cur_val);
+  if (cluster_req_buf) cluster_srv_write();
 
-    } else sprintf(ret + strlen(ret), ",rep:%u", stage_cur_val);
+  while (cluster_in_flight) {
 
-  }
+    s32 r = read(cluster_srv_res_fd, res_buf + res_len, sizeof(res_buf) - res_len);
+    u32 i, rec[2];
 
-  if (hnb == 2) strcat(ret, ",+cov");
+    if (r < 0 && (errno == EAGAIN || errno == EINTR)) break;
 
-  return ret;
+    if (r <= 0) {
+      if (stop_soon) return;
+      FATAL("Clustering server has gone away");
+    }
 
-}
+    res_len += r;
 
-#endif /* !SIMPLE_FILES */
+    for (i = 0; i + sizeof(rec) <= res_len && cluster_in_flight; i += sizeof(rec)) {
 
+      struct queue_entry *q;
 
-/* Write a message accompanying the crash directory :-) */
+      memcpy(rec, res_buf + i, sizeof(rec));
+      q = vector_get(queue_entry_id_vec, rec[0]);
+      cluster_remove_child(cluster_unassigned, q);
+      cluster_add_child(cluster_manager_get_cluster(cluster_manager, rec[1]), q);
+      LOGF("[cluster] [seed %d] [cluster %d] [elapsed %llu] [time %llu]\n", q->entry_id, rec[1], get_cur_time() - cluster_sent_time, get_cur_time() - start_time);
+      cluster_in_flight--;
 
-static void write_crash_readme(void) {
+    }
 
-  u8* fn = alloc_printf("%s/crashes/README.txt", out_dir);
-  s32 fd;
-  FILE* f;
+    memmove(res_buf, res_buf + i, res_len - i);
+    res_len -= i;
 
-  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-  ck_free(fn);
+  }
 
-  /* Do not die on errors here - that would be impolite. */
+}
 
-  if (fd < 0) return;
+/* Classify the entries parked in cluster_unassigned since the last batch. */
 
-  f = fdopen(fd, "w");
+static void cluster_flush(void) {
 
-  if (!f) {
-    close(fd);
-    return;
+  u32 i;
+
+  if (py_clustering) {
+    if (cluster_in_flight) return;
+    cluster_srv_send();
+  } else {
+    u32 n = vector_size(cluster_pending);
+    u64 clustering_start_time = get_cur_time();
+    const u64 **vecs = ck_alloc(n * sizeof(u64 *));
+    u32 *labels = ck_alloc(n * sizeof(u32));
+    for (i = 0; i < n; i++)
+      vecs[i] = ((struct queue_entry *)vector_get(cluster_pending, i))->dfg_arr->data;
+    if (cluster_online) {
+      kmeans_partial_fit(cluster_model, vecs, n, labels);
+    } else {
+      for (i = 0; i < n; i++) labels[i] = kmeans_predict(cluster_model, vecs[i]);
+    }
+    for (i = 0; i < n; i++)
+      assign_cluster(vector_get(cluster_pending, i), labels[i], clustering_start_time);
+    ck_free(vecs);
+    ck_free(labels);
+    vector_clear(cluster_pending);
   }
 
-  fprintf(f, "Command line used to find this crash:\n\n"
+  cluster_flush_time = get_cur_time();
 
-             "%s\n\n"
+}
 
-             "If you can't reproduce a bug outside of afl-fuzz, be sure to set the same\n"
-             "memory limit. The limit used for this fuzzing session was %s.\n\n"
+/* Park a new entry in cluster_unassigned, where it can be scheduled as
+   usual, and classify a batch once CLUSTER_BATCH_SIZE have gathered. */
 
-             "Need a tool to minimize test cases before investigating the crashes or sending\n"
-             "them to a vendor? Check out the afl-tmin that comes with the fuzzer!\n\n"
+static void cluster_defer(struct queue_entry *q) {
 
-             "Found any cool bugs in open-source tools using afl-fuzz? If yes, please drop\n"
-             "me a mail at <lcamtuf@coredump.cx> once the issues are fixed - I'd love to\n"
-             "add your finds to the gallery at:\n\n"
+  if (!q->dfg_arr) return;
 
-             "  http://lcamtuf.coredump.cx/afl/\n\n"
+  cluster_add_child(cluster_unassigned, q);
+  push_back(cluster_pending, q);
 
-             "Thanks :-)\n",
+  if (vector_size(cluster_pending) >= CLUSTER_BATCH_SIZE) cluster_flush();
 
-             orig_cmdline, DMS(mem_limit << 20)); /* ignore errors */
+}
 
-  fclose(f);
+/* Called from the main loop: pick up server replies, move a few entries
+   to closer clusters with AFL_CLUSTER_ONLINE, and classify whatever has
+   been parked for longer than CLUSTER_BATCH_TIME. */
 
-}
+static void cluster_tick(void) {
 
-void predict_clusters(u8 *out_file) {
+  if (cluster_srv_pid > 0) cluster_srv_poll();
 
-  u64 clustering_start_time = get_cur_time();
-  char *cludafl_dir = getenv("CLUDAFL");
-  if (cludafl_dir == NULL) {
-    FATAL("CLUDAFL environment variable not set");
-  }
-  char *cluster_cmd = alloc_printf("python3 %s/clustering.py %s kmeans %s", cludafl_dir, out_file, out_dir);
-  FILE *cluster_file = popen(cluster_cmd, "r");
-  if (cluster_file == NULL) {
-    FATAL("Failed to open cluster file");
-  }
-  char buffer[1024];
-  while (fgets(buffer, 1024, cluster_file) != NULL) {
-    // Read cluster info
-    u32 file_hash, cluster_id;
-    sscanf(buffer, "%u %u", &file_hash, &cluster_id);
-    struct key_value_pair *kvp = hashmap_get(queue_input_hash_map, file_hash);
-    if (kvp == NULL) {
-      FATAL("Failed to find file hash in hashmap");
-    }
-    struct queue_entry *q = kvp->value;
-    // Add q to cluster
-    cluster_add_child(cluster_manager_get_cluster(cluster_manager, cluster_id),q);
-    LOGF("[cluster] [seed %d] [cluster %d] [elapsed %llu] [time %llu]\n", q->entry_id, cluster_id, get_cur_time() - clustering_start_time, get_cur_time() - start_time);
-  }
-  pclose(cluster_file);
-  ck_free(cluster_cmd);
+  if (cluster_online) cluster_rebalance();
+
+  if (vector_size(cluster_pending) &&
+      get_cur_time() - cluster_flush_time >= CLUSTER_BATCH_TIME * 1000)
+    cluster_flush();
 
 }
 
@@ -3824,27 +5364,24 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
   u8  *fn = "";
   u8  hnb;
   s32 fd;
+  u32 mark = scratch_mark();
   u8  keeping = 0, res;
   u64 prox_score;
   u8 has_unique_memval = 0;
   is_interesting = 0;
 
+  if (val_busy) val_pool_reap(0);
+
   if (check_valid_res(fault)) {
     if (!ignore_valuation) {
-      has_unique_memval = get_valuation(argv, mem, len, is_crashed_at_target_loc());
-      is_interesting = has_unique_memval;
+      /* Set before get_valuation(), so that a job handed to the workers
+         knows whether this selection already counts as interesting. */
+      is_interesting = max_dfg_score() > queue_cur->dfg_max;
+      has_unique_memval = get_valuation(argv, queue_cur, mem, len, fault, 0);
       if (has_unique_memval) {
-        fn = alloc_printf("%s/memory/input/%s-%d", out_dir, fault == 0 ? "pos" : "neg", hashmap_size(val_hashmap));
-        fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        is_interesting = 1;
+        save_valuation_input(mem, len, fault);
         LOGF("[PacFuzz] [save_if_interesting] [seed %d] [inter %llu] [total %llu] [time %llu]\n", queue_cur ? queue_cur->entry_id : -1, mut_tracker_global->inter_num, mut_tracker_global->total_num, get_cur_time() - start_time);
-        if (fd < 0) PFATAL("Unable to create '%s'", fn);
-        ck_write(fd, mem, len, fn);
-        close(fd);
-        ck_free(fn);
-      } else {
-        u32 max_score = max_dfg_score();
-        if (max_score > queue_cur->dfg_max)
-          is_interesting = 1;
       }
     }
 
@@ -3852,11 +5389,11 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
       // CLUDAFL: Save run results if covered target
       if (check_target_covered() && total_reached_inputs < MAX_REACHED_INPUTS) {
         total_reached_inputs++;
-        u8* save_filename = alloc_printf("%s/cludafl/seeds/id:%06u,%lld,%llu,%s", out_dir, queued_paths, get_cur_time() - start_time, prox_score, describe_op(hnb));
+        u8* save_filename = scratch_printf("%s/cludafl/seeds/id:%06u,%lld,%llu,%s", out_dir, queued_paths, get_cur_time() - start_time, prox_score, describe_op(hnb));
         int fd = open(save_filename, O_WRONLY | O_CREAT | O_EXCL, 0600);
         ck_write(fd, mem, len, save_filename);
         close(fd);
-        ck_free(save_filename);
+        scratch_release(mark);
       }
     }
 
@@ -3895,24 +5432,12 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 
     res = calibrate_case(argv, queue_last, mem, queue_cycle - 1, 0);
 
-    if (select_strategy == SELECT_CLUSTER) {
-      // CLUDAFL: Save run results - this should be done after calibration
-      u8* save_filename = alloc_printf("%s/results.sbsv", out_dir);
-      FILE *save_file = fopen(save_filename, "w");
-      save_dry_run(save_file, queue_last, queue_last->exec_us, fault);
-      fclose(save_file);
-
-      predict_clusters(save_filename);
-      ck_free(save_filename);
-    }
+    if (select_strategy == SELECT_CLUSTER) cluster_defer(queue_last);
 
     if (res == FAULT_ERROR)
       FATAL("Unable to execute target application");
 
-    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0) PFATAL("Unable to create '%s'", fn);
-    ck_write(fd, mem, len, fn);
-    close(fd);
+    write_queue_entry(queue_last, mem, len);
 
     keeping = 1;
 
@@ -3933,11 +5458,7 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 
       if (!dumb_mode) {
 
-#ifdef WORD_SIZE_64
-        simplify_trace((u64*)trace_bits);
-#else
-        simplify_trace((u32*)trace_bits);
-#endif /* ^WORD_SIZE_64 */
+        simplify_trace(trace_bits);
 
         if (!has_new_bits(virgin_tmout)) return keeping;
 
@@ -3967,13 +5488,13 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 
 #ifndef SIMPLE_FILES
 
-      fn = alloc_printf("%s/hangs/id:%06llu,%s", out_dir,
-                        unique_hangs, describe_op(0));
+      fn = scratch_printf("%s/hangs/id:%06llu,%s", out_dir,
+                          unique_hangs, describe_op(0));
 
 #else
 
-      fn = alloc_printf("%s/hangs/id_%06llu", out_dir,
-                        unique_hangs);
+      fn = scratch_printf("%s/hangs/id_%06llu", out_dir,
+                          unique_hangs);
 
 #endif /* ^!SIMPLE_FILES */
 
@@ -3997,11 +5518,7 @@ keep_as_crash:
 
       if (!dumb_mode) {
 
-#ifdef WORD_SIZE_64
-        simplify_trace((u64*)trace_bits);
-#else
-        simplify_trace((u32*)trace_bits);
-#endif /* ^WORD_SIZE_64 */
+        simplify_trace(trace_bits);
 
         if (!has_new_bits(virgin_crash)) return keeping;
 
@@ -4014,14 +5531,14 @@ keep_as_crash:
 
 #ifndef SIMPLE_FILES
 
-      fn = alloc_printf("%s/crashes/id:%06llu,%llu,sig:%02u,%s", out_dir,
-                        unique_crashes, prox_score, kill_signal,
-                        describe_op(0));
+      fn = scratch_printf("%s/crashes/id:%06llu,%llu,sig:%02u,%s", out_dir,
+                          unique_crashes, prox_score, kill_signal,
+                          describe_op(0));
 
 #else
 
-      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, unique_crashes,
-                        kill_signal);
+      fn = scratch_printf("%s/crashes/id_%06llu_%02u", out_dir,
+                          unique_crashes, kill_signal);
 
 #endif /* ^!SIMPLE_FILES */
 
@@ -4046,7 +5563,7 @@ keep_as_crash:
   ck_write(fd, mem, len, fn);
   close(fd);
 
-  ck_free(fn);
+  scratch_release(mark);
 
   return keeping;
 
@@ -4170,6 +5687,17 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              /* ignore errors */
 
   fprintf(f, "total_reached_inputs: %llu\n", total_reached_inputs);
+
+  /* CPU time spent in afl-fuzz itself, as opposed to the targets. Used by
+     'make bench' to work out the fuzzer-side cost of an exec. */
+
+  if (!getrusage(RUSAGE_SELF, &usage))
+    fprintf(f, "fuzzer_cpu_ms     : %llu\n"
+               "wall_time_ms      : %llu\n",
+            (u64)usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec / 1000 +
+            (u64)usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec / 1000,
+            get_cur_time() - start_time);
+
   /* Get rss value from the children
      We must have killed the forkserver process and called waitpid
      before calling getrusage */
@@ -5339,16 +6867,9 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
   if (needs_write) {
 
-    s32 fd;
-
     unlink(q->fname); /* ignore errors */
 
-    fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
-
-    if (fd < 0) PFATAL("Unable to create '%s'", q->fname);
-
-    ck_write(fd, in_buf, q->len, q->fname);
-    close(fd);
+    write_queue_entry(q, in_buf, q->len);
 
     memcpy(trace_bits, clean_trace, MAP_SIZE);
     update_bitmap_score(q);
@@ -5363,6 +6884,9 @@ abort_trimming:
 }
 
 
+static u8 handle_fuzz_result(char** argv, u8* out_buf, u32 len, u8 fault);
+
+
 /* Write a modified test case, run program, process results. Handle
    error conditions, returning 1 if it's time to bail out. This is
    a helper function for fuzz_one(). */
@@ -5382,6 +6906,18 @@ EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
 
   fault = run_target(argv, exec_tmout);
 
+  return handle_fuzz_result(argv, out_buf, len, fault);
+
+}
+
+
+/* Process the results of a fuzzing exec; the second half of the above. Also
+   used for the test case a batch stopped at. */
+
+static u8 handle_fuzz_result(char** argv, u8* out_buf, u32 len, u8 fault) {
+
+  if (unlikely(bench_execs) && total_execs >= bench_execs) stop_soon = 2;
+
   if (stop_soon) return 1;
 
   if (fault == FAULT_TMOUT) {
@@ -5806,36 +7342,28 @@ u8* gen_llm_input(struct queue_entry *good_q1, struct queue_entry *good_q2, stru
   FILE *fp;
   if (good_q1 != NULL) {
     good_input_1 = ck_alloc(good_q1->len+1);
-    fp = fopen(good_q1->fname, "rb");
-    fread(good_input_1, 1, good_q1->len, fp);
-    fclose(fp);
+    read_queue_entry(good_q1, good_input_1);
     good_input_1=replaceWord(good_input_1, "\n", "\\n"); // Replace newline to "\\n" in json
     good_input_1=replaceWord(good_input_1, "\"", "\\\""); // Replace " to \" in json
     good_input_1=replaceWord(good_input_1, "\t", "    "); // Replace " to \" in json
   }
   if (good_q2 != NULL) {
     good_input_2 = ck_alloc(good_q2->len+1);
-    fp = fopen(good_q2->fname, "rb");
-    fread(good_input_2, 1, good_q2->len, fp);
-    fclose(fp);
+    read_queue_entry(good_q2, good_input_2);
     good_input_2=replaceWord(good_input_2, "\n", "\\n");
     good_input_2=replaceWord(good_input_2, "\"", "\\\"");
     good_input_2=replaceWord(good_input_2, "\t", "    ");
   }
   if (bad_q1 != NULL) {
     bad_input_1 = ck_alloc(bad_q1->len+1);
-    fp = fopen(bad_q1->fname, "rb");
-    fread(bad_input_1, 1, bad_q1->len, fp);
-    fclose(fp);
+    read_queue_entry(bad_q1, bad_input_1);
     bad_input_1=replaceWord(bad_input_1, "\n", "\\n");
     bad_input_1=replaceWord(bad_input_1, "\"", "\\\"");
     bad_input_1=replaceWord(bad_input_1, "\t", "    ");
   }
   if (bad_q2 != NULL) {
     bad_input_2 = ck_alloc(bad_q2->len+1);
-    fp = fopen(bad_q2->fname, "rb");
-    fread(bad_input_2, 1, bad_q2->len, fp);
-    fclose(fp);
+    read_queue_entry(bad_q2, bad_input_2);
     bad_input_2=replaceWord(bad_input_2, "\n", "\\n");
     bad_input_2=replaceWord(bad_input_2, "\"", "\\\"");
     bad_input_2=replaceWord(bad_input_2, "\t", "    ");
@@ -6037,7 +7565,7 @@ void run_llm_script(struct queue_entry *good_q1, struct queue_entry *good_q2, st
   if (good_q1 != NULL) {
     total_llm_input_cnt++;
     char* good_input_1 = alloc_printf("%s/cludafl/good/good-%llu", out_dir, total_llm_input_cnt);
-    link_or_copy(good_q1->fname, good_input_1);
+    copy_queue_entry(good_q1, good_input_1);
     ACTF("good1: %s", good_q1->fname);
     fprintf(fp, "good1\t%s\n", good_input_1);
     ck_free(good_input_1);
@@ -6045,7 +7573,7 @@ void run_llm_script(struct queue_entry *good_q1, struct queue_entry *good_q2, st
   if (good_q2 != NULL) {
     total_llm_input_cnt++;
     char* good_input_2 = alloc_printf("%s/cludafl/good/good-%llu", out_dir, total_llm_input_cnt);
-    link_or_copy(good_q2->fname, good_input_2);
+    copy_queue_entry(good_q2, good_input_2);
     ACTF("good2: %s", good_q2->fname);
     fprintf(fp, "good2\t%s\n", good_input_2);
     ck_free(good_input_2);
@@ -6053,7 +7581,7 @@ void run_llm_script(struct queue_entry *good_q1, struct queue_entry *good_q2, st
   if (bad_q1 != NULL) {
     total_llm_input_cnt++;
     char* bad_input_1 = alloc_printf("%s/cludafl/bad/bad-%llu", out_dir, total_llm_input_cnt);
-    link_or_copy(bad_q1->fname, bad_input_1); // atomic
+    copy_queue_entry(bad_q1, bad_input_1); // atomic
     ACTF("bad1: %s", bad_q1->fname);
     fprintf(fp, "bad1\t%s\n", bad_input_1);
     ck_free(bad_input_1);
@@ -6061,7 +7589,7 @@ void run_llm_script(struct queue_entry *good_q1, struct queue_entry *good_q2, st
   if (bad_q2 != NULL) {
     total_llm_input_cnt++;
     char* bad_input_2 = alloc_printf("%s/cludafl/bad/bad-%llu", out_dir, total_llm_input_cnt);
-    link_or_copy(bad_q2->fname, bad_input_2); // atomic
+    copy_queue_entry(bad_q2, bad_input_2); // atomic
     ACTF("bad2: %s", bad_q2->fname);
     fprintf(fp, "bad2\t%s\n", bad_input_2);
     ck_free(bad_input_2);
@@ -6089,31 +7617,32 @@ void get_new_input_from_llm(char **use_argv) {
       continue;
     }
     off_t file_size = file_stat.st_size;
-    // Make hard link to out_dir/queue
-    u8 *new_fn = alloc_printf("%s/queue/id:%06u,orig:%s", out_dir, vector_size(queue_entry_id_vec), llm_queue_entry->d_name);
-    link_or_copy(full_file_path, new_fn);
-    remove(full_file_path);
-    ck_free(full_file_path);
-    // Run dry_run
     u8 *buffer = ck_alloc(file_size + 1);
-    FILE *f = fopen(new_fn, "rb");
+    FILE *f = fopen(full_file_path, "rb");
     if (!f) {
-      FATAL("Failed to open '%s'", new_fn);
+      FATAL("Failed to open '%s'", full_file_path);
     }
     if (fread(buffer, 1, file_size, f) != file_size) {
-      FATAL("Short read from '%s'", new_fn);
+      FATAL("Short read from '%s'", full_file_path);
     }
+    fclose(f);
+    // Make hard link to out_dir/queue, unless it goes to the seed store
+    u8 *new_fn = alloc_printf("%s/queue/id:%06u,orig:%s", out_dir, vector_size(queue_entry_id_vec), llm_queue_entry->d_name);
+    if (!seed_store_on) link_or_copy(full_file_path, new_fn);
+    remove(full_file_path);
+    ck_free(full_file_path);
     // Run seed
     write_to_testcase(buffer, file_size);
     u8 fault = run_target(use_argv, exec_tmout);
-    ck_free(buffer);
     // If target timeout or other error, skip this input
     if (fault == FAULT_NONE || fault == FAULT_CRASH) {
       ACTF("Got new input from LLM!");
       add_to_queue(new_fn, file_size, 0, 0);
+      if (seed_store_on) seed_store_put(queue_last, buffer, file_size);
       perform_dry_run_single(use_argv, queue_last);
       LOGF("[llm] [new] [id %d] [size %ld] [res %d] [time %llu]\n", queue_last->entry_id, file_size, fault, get_cur_time() - start_time);
     }
+    ck_free(buffer);
   }
   closedir(llm_queue_dir);
   ck_free(llm_queue_dir_name);
@@ -6127,21 +7656,38 @@ struct queue_entry *select_next_dafl(void) {
     queue_cur = first_unhandled;
     first_unhandled = NULL;
   } else { // Proceed to the next unhandled item in the queue.
-    while (queue_cur && queue_cur->handled_in_cycle)
+    while (queue_cur && sched_handled(queue_cur))
       queue_cur = queue_cur->next;
   }
   return queue_cur;
 }
 
 /**
- * Select an input randomly
+ * Select an input uniformly at random
  */
 struct queue_entry *select_next_random(void) {
-  queue_cur = queue;
-  u32 random_index = rand() % queue_last->depth;
-  for (u32 i = 0; i < random_index; i++) {
-    queue_cur = queue_cur->next;
+  queue_cur = vector_get(queue_entry_id_vec, rand() % vector_size(queue_entry_id_vec));
+  return queue_cur;
+}
+
+/**
+ * Select an input at random, weighted by proximity score (plus one, so that
+ * nothing starves). The alias table is rebuilt whenever the queue has grown.
+ */
+struct queue_entry *select_next_random_prox(void) {
+  static struct alias_table *at = NULL;
+  static double *weights = NULL;
+  u32 n = vector_size(queue_entry_id_vec);
+
+  if (!at) at = alias_table_create();
+
+  if (at->size != n) {
+    weights = ck_realloc(weights, n * sizeof(double));
+    for (u32 i = 0; i < n; i++) weights[i] = (double)sched_idx.prox_score[i] + 1.0;
+    alias_table_build(at, weights, n);
   }
+
+  queue_cur = vector_get(queue_entry_id_vec, alias_table_sample(at));
   return queue_cur;
 }
 
@@ -6165,16 +7711,15 @@ struct queue_entry *select_next_cluster_dafl(void) {
   }
   clu = vector_get(cluster_manager->clusters, cluster_manager->cur_cluster);
   cluster_manager->cur_cluster++;
+  if (clu == cluster_unassigned && !cluster_size(clu)) return select_next_cluster_dafl();
 
   struct list_entry *selected = NULL;
   // Select next input
   if (clu->first_unhandled) { // This is set only when a new item was added.
     selected = clu->first_unhandled;
     clu->first_unhandled = NULL;
-  } else { // Proceed to the next unhandled item in the queue.
-    struct list_entry *le = clu->cur;
-    while (le && ((struct queue_entry*)le->data)->handled_in_cycle)
-      le = le->next;
+  } else { // Proceed to the next unhandled item in the cluster.
+    struct list_entry *le = cluster_first_unhandled(clu);
     if (le) {
       selected = le;
       clu->cur = le;
@@ -6202,9 +7747,10 @@ struct queue_entry *select_next_mab(void) {
     double global_gradient = (double)mut_tracker_global->inter_num / (double)(mut_tracker_global->total_num + 1);
     double global_gradient_short = mut_tracker_get_short_term_gradient(mut_tracker_global, short_len);
     while (queue_cur) {
-      if (!queue_cur->handled_in_cycle) {
+      u32 id = queue_cur->entry_id;
+      if (sched_idx.handled[id] != sched_idx.epoch) {
         // Use beta distribution to decide whether to select this input
-        if (queue_cur->mut_tracker->inter_num > 0) {
+        if (sched_idx.inter_num[id] > 0) {
           // If the gradient is higher than the global gradient, check short-term gradient
           u64 total_diff = queue_u64_diff(queue_cur->mut_tracker->total_queue, short_len);
           if (total_diff >= short_len) {
@@ -6213,10 +7759,13 @@ struct queue_entry *select_next_mab(void) {
               // Reset
               LOGF("[mab] [reset] [entry %d] [gg %f] [ggs %f] [sg %f] [s %llu] [sl %llu]\n", queue_cur->entry_id, global_gradient, global_gradient_short, short_term_gradient, total_selections, short_len);
               mut_tracker_reset(queue_cur->mut_tracker);
+              sched_index_sync(queue_cur);
             }
           }
         }
-        struct beta_dist bd_cur = mut_tracker_get(queue_cur->mut_tracker);
+        struct beta_dist bd_cur;
+        bd_cur.alpha = (double)(sched_idx.inter_num[id] + 2);
+        bd_cur.beta = (double)(sched_idx.total_num[id] - sched_idx.inter_num[id] + 2);
         double score = beta_rand_mt(beta_dist_update(bd_cur, bd));
         double r = (double)rand() / RAND_MAX;
         if (score > r) {
@@ -6239,6 +7788,8 @@ struct queue_entry *select_next(void) {
       return select_next_dafl();
     case SELECT_RANDOM:
       return select_next_random();
+    case SELECT_RANDOM_PROX:
+      return select_next_random_prox();
     case SELECT_CLUSTER:
       return select_next_cluster_dafl();
     case SELECT_MAB: {
@@ -6249,48 +7800,47 @@ struct queue_entry *select_next(void) {
         u64 max_input_len = 8192;
         if (global_inter_num == 0 && total_selections > 5) {
           // Generate new input with LLM
-          for (int i = 0; i < vector_size(queue_entry_id_vec); i++) {
+          u64 *inter = sched_idx.inter_num, *total = sched_idx.total_num;
+          for (u32 i = 0; i < sched_idx.size; i++) {
+            if (!inter[i] && !total[i]) continue;
             struct queue_entry *q = vector_get(queue_entry_id_vec, i);
-            u64 inter_num = q->mut_tracker->inter_num;
             if (q->len > max_input_len) {
               continue;
             }
-            if (inter_num > 0) {
+            if (inter[i] > 0) {
               if (!good_first) {
                 good_first = q;
               } else if (!good_second) {
                 good_second = q;
-                if (good_first->mut_tracker->inter_num < good_second->mut_tracker->inter_num) {
+                if (inter[good_first->entry_id] < inter[i]) {
                   struct queue_entry *tmp = good_first;
                   good_first = good_second;
                   good_second = tmp;
                 }
               } else {
-                if (q->mut_tracker->inter_num > good_first->mut_tracker->inter_num) {
+                if (inter[i] > inter[good_first->entry_id]) {
                   good_second = good_first;
                   good_first = q;
-                } else if (q->mut_tracker->inter_num > good_second->mut_tracker->inter_num) {
+                } else if (inter[i] > inter[good_second->entry_id]) {
                   good_second = q;
                 }
               }
             } else {
-              if (q->mut_tracker->total_num > 0) {
-                if (!bad_first) {
+              if (!bad_first) {
+                bad_first = q;
+              } else if (!bad_second) {
+                bad_second = q;
+                if (total[bad_first->entry_id] < total[i]) {
+                  struct queue_entry *tmp = bad_first;
+                  bad_first = bad_second;
+                  bad_second = tmp;
+                }
+              } else {
+                if (total[i] > total[bad_first->entry_id]) {
+                  bad_second = bad_first;
                   bad_first = q;
-                } else if (!bad_second) {
+                } else if (total[i] > total[bad_second->entry_id]) {
                   bad_second = q;
-                  if (bad_first->mut_tracker->total_num < bad_second->mut_tracker->total_num) {
-                    struct queue_entry *tmp = bad_first;
-                    bad_first = bad_second;
-                    bad_second = tmp;
-                  }
-                } else {
-                  if (q->mut_tracker->total_num > bad_first->mut_tracker->total_num) {
-                    bad_second = bad_first;
-                    bad_first = q;
-                  } else if (q->mut_tracker->total_num > bad_second->mut_tracker->total_num) {
-                    bad_second = q;
-                  }
                 }
               }
             }
@@ -6356,15 +7906,127 @@ void log_mutator(struct queue_entry *q, u32* mut_log, u32 multiplier) {
   //   mut_tracker_update_queue(mut_tracker_global);
   // }
   mut_tracker_update_queue(q->mut_tracker);
+  sched_index_sync(q);
+}
+
+/* Run the test cases waiting in the batch. The target works through them
+   until it hits one we need to look at (see BATCH_MAX in config.h); that
+   one gets the regular treatment, the ones before it only get counted, and
+   the ones after it wait for the next round-trip. Returns 1 if it's time to
+   bail out, like common_fuzz_stuff(). */
+
+static u8 batch_flush(char** argv) {
+
+  u32* off  = BATCH_OFF(batch_shm);
+  u32* lens = BATCH_LEN(batch_shm);
+  u8*  data = BATCH_DATA(batch_shm);
+
+  while (batch_cnt) {
+
+    u32 cur, i;
+    u8  fault;
+
+    if (batch_virgin_stale) {
+      memcpy(BATCH_VIRGIN(batch_shm), virgin_bits, MAP_SIZE);
+      batch_virgin_stale = 0;
+    }
+
+    batch_shm[BATCH_HDR_CNT]     = batch_cnt;
+    batch_shm[BATCH_HDR_CUR]     = 0;
+    batch_shm[BATCH_HDR_TARGET]  = dfg_target_idx;
+    batch_shm[BATCH_HDR_DFG_MAX] = ignore_valuation ? 0xffffffff :
+                                   queue_cur->dfg_max;
+
+    fault = run_target(argv, exec_tmout * batch_cnt);
+
+    batch_shm[BATCH_HDR_CNT] = 0;
+
+    cur = MIN(batch_shm[BATCH_HDR_CUR], batch_cnt - 1);
+
+    /* Everything before cur exited normally with nothing new to show, so
+       save_if_interesting() would have passed on it. */
+
+    total_execs   += cur;
+    is_interesting = 0;
+
+    for (i = 0; i < cur; i++)
+      log_mutator(queue_cur, batch_mut_log[i], batch_mult[i]);
+
+    cur_mut_log  = batch_mut_log[cur];
+    cur_mut_mult = batch_mult[cur];
+
+    if (handle_fuzz_result(argv, data + off[cur], lens[cur], fault)) {
+      cur_mut_log = NULL;
+      batch_cnt = batch_data_len = 0;
+      return 1;
+    }
+
+    cur_mut_log = NULL;
+
+    log_mutator(queue_cur, batch_mut_log[cur], batch_mult[cur]);
+
+    /* Move whatever the target did not get to to the front. */
+
+    cur++;
+
+    if (cur < batch_cnt) {
+
+      u32 shift = off[cur];
+
+      memmove(data, data + shift, batch_data_len - shift);
+
+      for (i = cur; i < batch_cnt; i++) {
+        off[i - cur]  = off[i] - shift;
+        lens[i - cur] = lens[i];
+        batch_mult[i - cur] = batch_mult[i];
+        memcpy(batch_mut_log[i - cur], batch_mut_log[i],
+               sizeof(batch_mut_log[0]));
+      }
+
+      batch_data_len -= shift;
+
+    } else batch_data_len = 0;
+
+    batch_cnt -= cur;
+
+  }
+
+  return 0;
+
+}
+
+
+/* Queue a havoc test case for batched execution, running the batch once it
+   fills up. Returns 1 if it's time to bail out. */
+
+static u8 batch_add(char** argv, u8* buf, u32 len, u32* mut_log,
+                    u32 multiplier) {
+
+  if (len > BATCH_DATA_SIZE - batch_data_len && batch_flush(argv)) return 1;
+
+  memcpy(BATCH_DATA(batch_shm) + batch_data_len, buf, len);
+
+  BATCH_OFF(batch_shm)[batch_cnt] = batch_data_len;
+  BATCH_LEN(batch_shm)[batch_cnt] = len;
+  batch_mult[batch_cnt] = multiplier;
+  memcpy(batch_mut_log[batch_cnt], mut_log, sizeof(batch_mut_log[0]));
+
+  batch_data_len += len;
+
+  if (++batch_cnt == batch_size) return batch_flush(argv);
+
+  return 0;
+
 }
 
+
 /* Take the current entry from the queue, fuzz it for a while. This
    function is a tad too long... returns 0 if fuzzed successfully, 1 if
    skipped or bailed out. */
 
 static u8 fuzz_one(char** argv) {
 
-  s32 len, fd, temp_len, i, j;
+  s32 len, temp_len, i, j;
   u8  *in_buf, *out_buf, *orig_in, *ex_tmp, *eff_map = 0;
   u64 havoc_queued,  orig_hit_cnt, new_hit_cnt;
   u32 splice_cycle = 0, perf_score = 100, orig_perf, prev_cksum, eff_cnt = 1;
@@ -6420,25 +8082,17 @@ static u8 fuzz_one(char** argv) {
     fflush(stdout);
   }
 
-  /* Map the test case into memory. */
-
-  fd = open(queue_cur->fname, O_RDONLY);
-
-  if (fd < 0) PFATAL("Unable to open '%s'", queue_cur->fname);
+  /* Map the test case into memory (read-only; see seed_cache_get()). */
 
   len = queue_cur->len;
 
-  orig_in = in_buf = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-
-  if (orig_in == MAP_FAILED) PFATAL("Unable to mmap '%s'", queue_cur->fname);
-
-  close(fd);
+  orig_in = in_buf = seed_cache_get(queue_cur);
 
   /* We could mmap() out_buf as MAP_PRIVATE, but we end up clobbering every
      single byte anyway, so it wouldn't give us any performance or memory usage
-     benefits. */
+     benefits. It does get reused from one seed to the next, though. */
 
-  out_buf = ck_alloc_nozero(len);
+  out_buf = out_arena_take(len);
 
   subseq_tmouts = 0;
 
@@ -6480,7 +8134,18 @@ static u8 fuzz_one(char** argv) {
 
   if (!dumb_mode && !queue_cur->trim_done) {
 
-    u8 res = trim_case(argv, queue_cur, in_buf);
+    u8 res;
+
+    /* The test case is mapped read-only and the trimmer edits in_buf in
+       place, so it gets a copy; whatever it saves is picked up after. */
+
+    in_buf = ck_alloc_nozero(len);
+    memcpy(in_buf, orig_in, len);
+
+    res = trim_case(argv, queue_cur, in_buf);
+
+    ck_free(in_buf);
+    orig_in = in_buf = seed_cache_get(queue_cur);
 
     if (res == FAULT_ERROR)
       FATAL("Unable to execute target application");
@@ -7933,12 +9598,28 @@ havoc_stage:
         mut_log[mut]++;
     }
 
-    // Run the test case
-    if (common_fuzz_stuff(argv, out_buf, temp_len))
-      goto abandon_entry;
+    // Run the test case, or queue it up if the target takes batches
+    if (batch_size && batch_shm[BATCH_HDR_MAGIC] == BATCH_MAGIC) {
+
+      if (batch_add(argv, out_buf, temp_len, mut_log, multiplier))
+        goto abandon_entry;
+
+    } else {
+
+      cur_mut_log  = mut_log;
+      cur_mut_mult = multiplier;
+
+      if (common_fuzz_stuff(argv, out_buf, temp_len)) {
+        cur_mut_log = NULL;
+        goto abandon_entry;
+      }
+
+      cur_mut_log = NULL;
 
-    // if (select_strategy==SELECT_MAB) // Update the beta dist. for each input and mutator
-    log_mutator(queue_cur, mut_log, multiplier);
+      // if (select_strategy==SELECT_MAB) // Update the beta dist. for each input and mutator
+      log_mutator(queue_cur, mut_log, multiplier);
+
+    }
 
     /* out_buf might have been mangled a bit, so let's restore it to its
        original size and shape. */
@@ -7963,6 +9644,8 @@ havoc_stage:
 
   }
 
+  if (batch_cnt && batch_flush(argv)) goto abandon_entry;
+
   new_hit_cnt = queued_paths + unique_crashes;
 
   if (!splice_cycle) {
@@ -8019,15 +9702,9 @@ retry_splicing:
 
     /* Read the testcase into a new buffer. */
 
-    fd = open(target->fname, O_RDONLY);
-
-    if (fd < 0) PFATAL("Unable to open '%s'", target->fname);
-
     new_buf = ck_alloc_nozero(target->len);
 
-    ck_read(fd, new_buf, target->len, target->fname);
-
-    close(fd);
+    read_queue_entry(target, new_buf);
 
     /* Find a suitable splicing location, somewhere between the first and
        the last differing byte. Bail out if the difference is just a single
@@ -8075,10 +9752,8 @@ abandon_entry:
     if (queue_cur->favored) pending_favored--;
   }
 
-  munmap(orig_in, queue_cur->len);
-
   if (in_buf != orig_in) ck_free(in_buf);
-  ck_free(out_buf);
+  out_arena_give(out_buf);
   ck_free(eff_map);
 
   return ret_val;
@@ -8234,6 +9909,9 @@ static void handle_stop_sig(int sig) {
 
   if (child_pid > 0) kill(child_pid, SIGKILL);
   if (forksrv_pid > 0) kill(forksrv_pid, SIGKILL);
+  if (val_forksrv_pid > 0) kill(val_forksrv_pid, SIGKILL);
+
+  val_pool_kill();
 
 }
 
@@ -8417,6 +10095,14 @@ EXP_ST void check_binary(u8* fname) {
 
   }
 
+  if (!dumb_mode &&
+      memmem(f_data, f_len, SHM_FUZZ_SIG, strlen(SHM_FUZZ_SIG) + 1)) {
+
+    OKF(cPIN "Shared memory test case delivery detected.");
+    setup_shm_fuzz();
+
+  }
+
   if (memmem(f_data, f_len, DEFER_SIG, strlen(DEFER_SIG) + 1)) {
 
     OKF(cPIN "Deferred forkserver binary detected.");
@@ -9235,14 +10921,59 @@ void init_dfg(char *dfg_filename) {
 }
 
 
-void init_clusters() {
+/* Fit k-means on the DFG vectors of the dry run and sort the initial queue
+   into one cluster per centroid. */
+
+static void init_clusters_native(void) {
+
+  u64 clustering_start_time = get_cur_time();
+  u32 dim = vector_size(dfg_info_vector), n = 0, i = 0, j;
+  struct queue_entry *q;
+  double *pts;
+  u32 *labels;
+
+  for (q = queue; q; q = q->next)
+    if (q->dfg_arr) n++;
+
+  if (!n) FATAL("No DFG vectors to cluster");
+
+  pts = ck_alloc((u64)n * dim * sizeof(double));
+  labels = ck_alloc(n * sizeof(u32));
+
+  for (q = queue; q; q = q->next) {
+    if (!q->dfg_arr) continue;
+    for (j = 0; j < dim; j++) pts[(u64)i * dim + j] = q->dfg_arr->data[j];
+    i++;
+  }
+
+  cluster_model = kmeans_fit_auto(pts, n, dim, labels, ((u64)random() << 32) ^ random());
+
+  for (j = 0; j < cluster_model->k; j++)
+    cluster_manager_add_cluster(cluster_manager, cluster_create(j));
+
+  i = 0;
+  for (q = queue; q; q = q->next) {
+    if (!q->dfg_arr) continue;
+    cluster_add_child(cluster_manager_get_cluster(cluster_manager, labels[i++]), q);
+  }
+
+  OKF("Sorted %u seeds into %u clusters in %llu ms.", n, cluster_model->k,
+      get_cur_time() - clustering_start_time);
+
+  ck_free(pts);
+  ck_free(labels);
+
+}
+
+/* Same as above, with clustering.py; it stays up as a server afterwards. */
+
+static void init_clusters_py(void) {
 
   char *cludafl_dir = getenv("CLUDAFL");
   if (cludafl_dir == NULL) {
     FATAL("CLUDAFL environment variable not set");
   }
-  cluster_manager = cluster_manager_create();
-  char *cluster_cmd = alloc_printf("python3 %s/clustering.py %s/dry_run_results.sbsv kmeans %s", cludafl_dir, out_dir, out_dir);
+  char *cluster_cmd = alloc_printf("python3 %s/clustering.py %s/dfg_vectors.bin kmeans %s", cludafl_dir, out_dir, out_dir);
   FILE *cluster_file = popen(cluster_cmd, "r");
   if (cluster_file == NULL) {
     FATAL("Failed to open cluster file");
@@ -9270,6 +11001,22 @@ void init_clusters() {
   }
   vector_free(cluster_manager->clusters);
   cluster_manager->clusters = new_vector;
+  cluster_srv_start();
+}
+
+void init_clusters() {
+
+  cluster_manager = cluster_manager_create();
+
+  if (py_clustering) init_clusters_py();
+  else init_clusters_native();
+
+  cluster_unassigned = cluster_create(vector_size(cluster_manager->clusters));
+  cluster_manager_add_cluster(cluster_manager, cluster_unassigned);
+
+  cluster_pending = vector_create();
+  cluster_flush_time = get_cur_time();
+
 }
 
 #ifndef AFL_LIB
@@ -9285,6 +11032,9 @@ static void init_cludafl() {
 
 static void destroy_cludafl() {
   vector_free(queue_entry_id_vec);
+  sched_index_free();
+  kmeans_free(cluster_model);
+  if (cluster_pending) vector_free(cluster_pending);
   hashmap_free(queue_input_hash_map);
   hashmap_free(dfg_hash_map);
   hashmap_free(val_hashmap);
@@ -9297,7 +11047,7 @@ int main(int argc, char** argv) {
 
   s32 opt;
   u64 prev_queued = 0;
-  u32 sync_interval_cnt = 0;
+  u32 sync_interval_cnt = 0, i;
   u8  *extras_dir = 0;
   u8  mem_limit_given = 0;
   u8  exit_1 = !!getenv("AFL_BENCH_JUST_ONE");
@@ -9517,11 +11267,12 @@ int main(int argc, char** argv) {
       case 's':
         if (strcmp(optarg, "dafl") == 0) select_strategy = SELECT_DAFL;
         else if (strcmp(optarg, "random") == 0) select_strategy = SELECT_RANDOM;
+        else if (strcmp(optarg, "random_prox") == 0) select_strategy = SELECT_RANDOM_PROX;
         else if (strcmp(optarg, "cluster") == 0) select_strategy = SELECT_CLUSTER;
         else if (strcmp(optarg, "dafl_cluster") == 0) select_strategy = SELECT_CLUSTER;
         else if (strcmp(optarg, "random_cluster") == 0) select_strategy = SELECT_CLUSTER;
         else if (strcmp(optarg, "mab") == 0) select_strategy = SELECT_MAB;
-        else FATAL("Unsupported strategy, it should be 'dafl', 'random', 'cluster', 'dafl_cluster', 'random_cluster' or 'mab");
+        else FATAL("Unsupported strategy, it should be 'dafl', 'random', 'random_prox', 'cluster', 'dafl_cluster', 'random_cluster' or 'mab");
         break;
 
       case 'l':
@@ -9571,6 +11322,40 @@ int main(int argc, char** argv) {
     if (!hang_tmout) FATAL("Invalid value of AFL_HANG_TMOUT");
   }
 
+  if (getenv("PACFIX_VAL_TMOUT")) {
+    val_tmout = atoi(getenv("PACFIX_VAL_TMOUT"));
+    if (val_tmout < 5) FATAL("Invalid value of PACFIX_VAL_TMOUT");
+  }
+
+  if (getenv("PACFIX_VAL_WORKERS")) {
+    val_worker_cnt = atoi(getenv("PACFIX_VAL_WORKERS"));
+    if (val_worker_cnt < 1 || val_worker_cnt > VAL_WORKERS_MAX)
+      FATAL("PACFIX_VAL_WORKERS must be between 1 and %u", VAL_WORKERS_MAX);
+  }
+
+  if (getenv("AFL_BATCH_SIZE")) {
+    batch_size = atoi(getenv("AFL_BATCH_SIZE"));
+    if (batch_size < 2 || batch_size > BATCH_MAX)
+      FATAL("AFL_BATCH_SIZE must be between 2 and %u", BATCH_MAX);
+  }
+
+  if (getenv("AFL_SEED_STORE")) {
+    if (sync_id) FATAL("AFL_SEED_STORE and -S / -M are mutually exclusive");
+    seed_store_on = 1;
+  }
+
+  if (getenv("AFL_PY_CLUSTERING")) py_clustering = 1;
+
+  if (getenv("AFL_CLUSTER_ONLINE")) {
+    if (py_clustering) FATAL("AFL_CLUSTER_ONLINE and AFL_PY_CLUSTERING are mutually exclusive");
+    cluster_online = 1;
+  }
+
+  if (getenv("AFL_BENCH_EXECS")) {
+    bench_execs = strtoull(getenv("AFL_BENCH_EXECS"), NULL, 10);
+    if (!bench_execs) FATAL("Invalid value of AFL_BENCH_EXECS");
+  }
+
   if (dumb_mode == 2 && no_forkserver)
     FATAL("AFL_DUMB_FORKSRV and AFL_NO_FORKSRV are mutually exclusive");
 
@@ -9599,9 +11384,10 @@ int main(int argc, char** argv) {
 
   setup_post();
   setup_shm();
-  init_count_class16();
+  init_bitmap_kernels();
 
   setup_dirs_fds();
+  if (seed_store_on) seed_store_init();
   read_testcases();
   load_auto();
 
@@ -9617,6 +11403,8 @@ int main(int argc, char** argv) {
 
   check_binary(argv[optind]);
 
+  if (batch_size) setup_shm_batch();
+
   start_time = get_cur_time();
 
   if (qemu_mode)
@@ -9688,8 +11476,9 @@ int main(int argc, char** argv) {
       cur_skipped_paths = 0;
       queue_cur = queue;
 
-      for (struct queue_entry* q_tmp = queue; q_tmp; q_tmp = q_tmp->next)
-        q_tmp->handled_in_cycle = 0;
+      sched_index_new_cycle();
+
+      queue_unhandled = queue;
 
       show_stats();
 
@@ -9715,7 +11504,7 @@ int main(int argc, char** argv) {
     }
 
     /* Note that even if we skip the current item, it's considered "handled". */
-    queue_cur->handled_in_cycle = 1;
+    sched_set_handled(queue_cur);
     current_entry = queue_cur->entry_id;
 
     skipped_fuzz = fuzz_one(use_argv);
@@ -9735,9 +11524,11 @@ int main(int argc, char** argv) {
     //   queue_cur = first_unhandled;
     //   first_unhandled = NULL;
     // } else { // Proceed to the next unhandled item in the queue.
-    //   while (queue_cur && queue_cur->handled_in_cycle)
+    //   while (queue_cur && sched_handled(queue_cur))
     //     queue_cur = queue_cur->next;
     // }
+    if (select_strategy == SELECT_CLUSTER) cluster_tick();
+
     queue_cur = select_next();
     if (use_llm) {
       get_new_input_from_llm(use_argv);
@@ -9751,7 +11542,16 @@ int main(int argc, char** argv) {
   if (stop_soon == 2) {
       if (child_pid > 0) kill(child_pid, SIGKILL);
       if (forksrv_pid > 0) kill(forksrv_pid, SIGKILL);
+      if (val_forksrv_pid > 0) kill(val_forksrv_pid, SIGKILL);
+      val_pool_kill();
   }
+  if (val_forksrv_pid > 0) waitpid(val_forksrv_pid, NULL, 0);
+  if (cluster_srv_pid > 0) {
+    close(cluster_srv_fd);
+    waitpid(cluster_srv_pid, NULL, 0);
+  }
+  for (i = 0; i < val_worker_cnt; i++)
+    waitpid(val_workers[i].fsrv_pid, NULL, 0);
   /* Now that we've killed the forkserver, we wait for it to be able to get rusage stats. */
   if (waitpid(forksrv_pid, NULL, 0) <= 0) {
     WARNF("error waitpid\n");
@@ -9782,6 +11582,10 @@ stop_fuzzing:
   curl_easy_cleanup(curl);
   curl_global_cleanup();
 #endif
+  if (seed_store_on) {
+    if (getenv("AFL_SEED_STORE_EXPORT")) seed_store_export();
+    seed_store_close();
+  }
   destroy_queue();
   destroy_extras();
   ck_free(target_path);
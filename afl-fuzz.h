@@ -17,11 +17,17 @@
 #define INTERVAL_SIZE 1024
 #define MAX_SCHEDULER_NUM 16
 #define MAX_QUEUE_U64_SIZE 8192
+#define QUEUE_U64_INIT_SIZE 16 // should be power of 2
 #define QUEUE_U64_GLOBAL_ENQUEUE_NUM 100
+// Slab allocator: chunk size, minimum objects per chunk, size classes
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_MIN_OBJS 16
+#define SLAB_CLASSES 16
 
 enum selection_strategy {
   SELECT_DAFL,
   SELECT_RANDOM,
+  SELECT_RANDOM_PROX,
   SELECT_CLUSTER,
   SELECT_MAB,
 };
@@ -40,21 +46,74 @@ struct dfg_node_info {
   u32 max_paths;
 };
 
+/**
+ * Slab allocator for the small fixed-shape objects every seed carries
+ * (mut_tracker, its arrays, dfg_arr, list nodes). Objects of one size are
+ * carved out of shared chunks and recycled through a free list, so each one
+ * costs its own size rather than a ck_alloc() header and canary apiece.
+ * Chunks are never returned; objects come back zeroed like ck_alloc().
+ */
+struct slab {
+  u32 obj_size;
+  u8 *cur;
+  u8 *end;
+  void *free_list;
+};
+
+static struct slab slab_classes[SLAB_CLASSES];
+static u32 slab_class_cnt;
+
+struct slab *slab_get(u32 obj_size) {
+  obj_size = (obj_size + 7) & ~7;
+  if (obj_size < sizeof(void *)) obj_size = sizeof(void *);
+  for (u32 i = 0; i < slab_class_cnt; i++) {
+    if (slab_classes[i].obj_size == obj_size) return &slab_classes[i];
+  }
+  if (slab_class_cnt == SLAB_CLASSES) {
+    FATAL("Too many slab size classes (%u)", SLAB_CLASSES);
+  }
+  slab_classes[slab_class_cnt].obj_size = obj_size;
+  return &slab_classes[slab_class_cnt++];
+}
+
+void *slab_alloc(struct slab *slab) {
+  void *obj;
+  if (slab->free_list) {
+    obj = slab->free_list;
+    slab->free_list = *(void **)obj;
+    memset(obj, 0, slab->obj_size);
+    return obj;
+  }
+  if ((u64)(slab->end - slab->cur) < slab->obj_size) {
+    u32 chunk = MAX(SLAB_CHUNK_SIZE, SLAB_MIN_OBJS * slab->obj_size);
+    slab->cur = (u8 *)ck_alloc(chunk);
+    slab->end = slab->cur + chunk;
+  }
+  obj = slab->cur;
+  slab->cur += slab->obj_size;
+  return obj;
+}
+
+void slab_free(struct slab *slab, void *obj) {
+  *(void **)obj = slab->free_list;
+  slab->free_list = obj;
+}
+
 struct array {
   u64 size;
   u64 *data;
 };
 
+// The elements live right behind the header, in one slab object.
 struct array *array_create(u64 size) {
-  struct array *arr = (struct array *)ck_alloc(sizeof(struct array));
+  struct array *arr = (struct array *)slab_alloc(slab_get(sizeof(struct array) + size * sizeof(u64)));
   arr->size = size;
-  arr->data = (u64 *)ck_alloc(size * sizeof(u64));
+  arr->data = (u64 *)(arr + 1);
   return arr;
 }
 
 void array_free(struct array *arr) {
-  ck_free(arr->data);
-  ck_free(arr);
+  slab_free(slab_get(sizeof(struct array) + arr->size * sizeof(u64)), arr);
 }
 
 void array_set(struct array *arr, u64 index, u64 value) {
@@ -86,54 +145,70 @@ u64 array_size(struct array *arr) {
 
 /* Multi-armed bandit stuffs */
 
+/**
+ * Bounded history ring. Storage is allocated on the first enqueue and grows
+ * by doubling, so seeds that are never fuzzed pay nothing. The slot count is
+ * always a power of two and positions are masked rather than taken modulo;
+ * only the last `limit` values are kept.
+ */
 struct queue_u64 {
-  struct array *data;
+  u64 *data;
+  u64 cap;   // Allocated slots: 0 or a power of two
+  u64 limit; // Values kept; the oldest is dropped beyond it
   u64 size;
   u64 front;
-  u64 rear;
 };
 
 struct queue_u64 *queue_u64_create(u64 size) {
-  struct queue_u64 *queue = (struct queue_u64 *)ck_alloc(sizeof(struct queue_u64));
-  queue->data = array_create(size);
-  queue->size = size;
-  queue->front = 0;
-  queue->rear = 0;
+  struct queue_u64 *queue = (struct queue_u64 *)slab_alloc(slab_get(sizeof(struct queue_u64)));
+  queue->limit = size ? size : 1;
   return queue;
 }
 
 void queue_u64_free(struct queue_u64 *queue) {
-  array_free(queue->data);
-  ck_free(queue);
+  ck_free(queue->data);
+  slab_free(slab_get(sizeof(struct queue_u64)), queue);
 }
 
 void queue_u64_clear(struct queue_u64 *queue) {
   queue->front = 0;
-  queue->rear = 0;
   queue->size = 0;
-  memset(queue->data->data, 0, array_size(queue->data) * sizeof(u64));
 }
 
 u64 queue_u64_index(struct queue_u64 *queue, u64 index) {
-  return (queue->front + index) % array_size(queue->data);
+  return (queue->front + index) & (queue->cap - 1);
+}
+
+// Move to a buffer twice as large, unrolling the ring so that front is 0.
+static void queue_u64_grow(struct queue_u64 *queue) {
+  u64 cap = queue->cap ? queue->cap * 2 : QUEUE_U64_INIT_SIZE;
+  u64 *data = (u64 *)ck_alloc_nozero(cap * sizeof(u64));
+  for (u64 i = 0; i < queue->size; i++) {
+    data[i] = queue->data[queue_u64_index(queue, i)];
+  }
+  ck_free(queue->data);
+  queue->data = data;
+  queue->cap = cap;
+  queue->front = 0;
 }
 
 u64 queue_u64_dequeue(struct queue_u64 *queue) {
   if (queue->size == 0) {
     return 0;
   }
-  u64 value = array_get(queue->data, queue->front);
+  u64 value = queue->data[queue->front];
   queue->front = queue_u64_index(queue, 1);
   queue->size--;
   return value;
 }
 
 void queue_u64_enqueue(struct queue_u64 *queue, u64 value) {
-  if (queue->size == array_size(queue->data)) {
+  if (queue->size == queue->limit) {
     queue_u64_dequeue(queue);
+  } else if (queue->size == queue->cap) {
+    queue_u64_grow(queue);
   }
-  array_set(queue->data, queue->rear, value);
-  queue->rear = (queue->rear + 1) % array_size(queue->data);
+  queue->data[queue_u64_index(queue, queue->size)] = value;
   queue->size++;
 }
 
@@ -145,17 +220,25 @@ u64 queue_u64_peek(struct queue_u64 *queue, u64 index) {
   if (queue->size == 0) {
     return 0;
   }
-  return array_get(queue->data, queue_u64_index(queue, index));
+#ifdef DEBUG_BUILD
+  if (index >= queue->size) {
+    FATAL("Index out of bounds: %llu >= %llu", index, queue->size);
+  }
+#endif /* DEBUG_BUILD */
+  return queue->data[queue_u64_index(queue, index)];
 }
 
+/**
+ * Difference between the newest value and the one window_size slots before
+ * it (or the oldest one, if the ring is shorter than that).
+ */
 u64 queue_u64_diff(struct queue_u64 *queue, u64 window_size) {
   if (queue->size == 0) {
     return 0;
   }
-  window_size = window_size > (queue->size - 1) ? (queue->size - 1) : window_size;
-  u64 front = queue_u64_peek(queue, queue->size - window_size - 1);
-  u64 rear = queue_u64_peek(queue, queue->size - 1);
-  return rear - front;
+  if (window_size > queue->size - 1) window_size = queue->size - 1;
+  u64 rear = queue_u64_index(queue, queue->size - 1);
+  return queue->data[rear] - queue->data[(rear - window_size) & (queue->cap - 1)];
 }
 
 double queue_u64_gradient(struct queue_u64 *queue, u64 window_size) {
@@ -261,7 +344,7 @@ double beta_rand_gsl(struct beta_dist dist) {
 #endif
 
 struct mut_tracker *mut_tracker_create() {
-  struct mut_tracker *tracker = (struct mut_tracker *)ck_alloc(sizeof(struct mut_tracker));
+  struct mut_tracker *tracker = (struct mut_tracker *)slab_alloc(slab_get(sizeof(struct mut_tracker)));
   tracker->size = 17;
   tracker->inter = array_create(tracker->size);
   tracker->total = array_create(tracker->size);
@@ -275,7 +358,8 @@ void mut_tracker_free(struct mut_tracker *tracker) {
   array_free(tracker->total);
   queue_u64_free(tracker->inter_queue);
   queue_u64_free(tracker->total_queue);
-  ck_free(tracker);
+  if (tracker->old) mut_tracker_free(tracker->old);
+  slab_free(slab_get(sizeof(struct mut_tracker)), tracker);
 }
 
 void mut_tracker_update(struct mut_tracker *tracker, u32 mut, u32 sel_num, u8 interesting, u32 multiplier) {
@@ -299,6 +383,17 @@ void mut_tracker_update_num(struct mut_tracker *tracker, u8 is_interesting) {
   tracker->total_num++;
 }
 
+/**
+ * Credit a selection that was already counted by mut_tracker_update() as
+ * interesting, once the result comes in.
+ */
+void mut_tracker_credit(struct mut_tracker *tracker, u32 *mut_log, u32 multiplier) {
+  for (u32 mut = 0; mut < tracker->size; mut++) {
+    tracker->inter->data[mut] += mut_log[mut] * multiplier;
+  }
+  tracker->inter_num++;
+}
+
 void mut_tracker_update_queue(struct mut_tracker *tracker) {
   queue_u64_enqueue(tracker->inter_queue, tracker->inter_num);
   queue_u64_enqueue(tracker->total_queue, tracker->total_num);
@@ -377,7 +472,6 @@ struct queue_entry {
   u8  cal_failed,                     /* Calibration failed?              */
       trim_done,                      /* Trimmed?                         */
       was_fuzzed,                     /* Had any fuzzing done yet?        */
-      handled_in_cycle,               /* Was handled in current cycle?    */
       passed_det,                     /* Deterministic stages passed?     */
       has_new_cov,                    /* Triggers new coverage?           */
       var_behavior,                   /* Variable behavior?               */
@@ -404,9 +498,81 @@ struct queue_entry {
   struct array *dfg_arr;
   struct mut_tracker *mut_tracker;
 
+  u64 store_off;                      /* Offset in the packed seed store  */
+  struct cluster *cluster;            /* Cluster it is in (-s cluster)    */
+
+  u64 sort_score,                     /* prox_score the order is based on */
+      sort_seq;                       /* Tie breaker: insertion order     */
+  u32 skip_lvl;                       /* Levels in the queue skip list    */
+  struct queue_entry **skip;          /* Skip list links above ->next     */
+
   struct queue_entry *next;           /* Next element, if any             */
 };
 
+/**
+ * Struct-of-arrays index over the scheduler-hot fields of the queue, by
+ * entry_id (the order of queue_entry_id_vec), so that scans and the
+ * per-cycle reset sweep contiguous memory instead of chasing queue_entry
+ * and mut_tracker pointers. An entry was handled in the current cycle if its
+ * stamp equals the cycle epoch, so a new cycle only bumps the epoch. The
+ * proximity score and the tracker counters are mirrored by
+ * sched_index_sync() whenever they change.
+ */
+struct sched_index {
+  u32 size;
+  u32 capacity;
+  u32 epoch;       // Current cycle; starts at 1 so zeroed stamps are unhandled
+  u32 *handled;    // Epoch in which the entry was last handled
+  u64 *prox_score; // queue_entry->prox_score
+  u64 *inter_num;  // mut_tracker->inter_num
+  u64 *total_num;  // mut_tracker->total_num
+};
+
+static struct sched_index sched_idx = { .epoch = 1 };
+
+void sched_index_sync(struct queue_entry *q) {
+  sched_idx.prox_score[q->entry_id] = q->prox_score;
+  sched_idx.inter_num[q->entry_id] = q->mut_tracker->inter_num;
+  sched_idx.total_num[q->entry_id] = q->mut_tracker->total_num;
+}
+
+// Entries must be added in entry_id order.
+void sched_index_add(struct queue_entry *q) {
+  if (q->entry_id != sched_idx.size) {
+    FATAL("Scheduler index out of step: %u != %u", q->entry_id, sched_idx.size);
+  }
+  if (sched_idx.size == sched_idx.capacity) {
+    sched_idx.capacity = sched_idx.capacity ? sched_idx.capacity * 2 : 64;
+    sched_idx.handled = ck_realloc(sched_idx.handled, sched_idx.capacity * sizeof(u32));
+    sched_idx.prox_score = ck_realloc(sched_idx.prox_score, sched_idx.capacity * sizeof(u64));
+    sched_idx.inter_num = ck_realloc(sched_idx.inter_num, sched_idx.capacity * sizeof(u64));
+    sched_idx.total_num = ck_realloc(sched_idx.total_num, sched_idx.capacity * sizeof(u64));
+  }
+  sched_idx.size++;
+  sched_index_sync(q);
+}
+
+static inline u8 sched_handled(struct queue_entry *q) {
+  return sched_idx.handled[q->entry_id] == sched_idx.epoch;
+}
+
+static inline void sched_set_handled(struct queue_entry *q) {
+  sched_idx.handled[q->entry_id] = sched_idx.epoch;
+}
+
+void sched_index_new_cycle(void) {
+  sched_idx.epoch++;
+}
+
+void sched_index_free(void) {
+  ck_free(sched_idx.handled);
+  ck_free(sched_idx.prox_score);
+  ck_free(sched_idx.inter_num);
+  ck_free(sched_idx.total_num);
+  memset(&sched_idx, 0, sizeof(sched_idx));
+  sched_idx.epoch = 1;
+}
+
 struct list_entry {
   void *data;
   struct list_entry *prev;
@@ -420,7 +586,7 @@ struct list {
 };
 
 struct list_entry* list_entry_create(void *data) {
-  struct list_entry *entry = (struct list_entry *)ck_alloc(sizeof(struct list_entry));
+  struct list_entry *entry = (struct list_entry *)slab_alloc(slab_get(sizeof(struct list_entry)));
   entry->data = data;
   entry->prev = NULL;
   entry->next = NULL;
@@ -509,7 +675,7 @@ void list_remove(struct list *list, struct list_entry *entry) {
   } else {
     list->tail = entry->prev;
   }
-  ck_free(entry);
+  slab_free(slab_get(sizeof(struct list_entry)), entry);
   list->size--;
 }
 
@@ -537,7 +703,7 @@ void list_free(struct list *list) {
   struct list_entry *entry = list->head;
   while (entry != NULL) {
     struct list_entry *next = entry->next;
-    ck_free(entry);
+    slab_free(slab_get(sizeof(struct list_entry)), entry);
     entry = next;
   }
   ck_free(list);
@@ -656,63 +822,173 @@ u32 vector_size(struct vector* vec) {
   return vec->size;
 }
 
-// Hashmap
+// Alias table (Vose's method): O(n) to build, O(1) to draw an index with
+// probability proportional to its weight.
+struct alias_table {
+  u32 size;
+  u32 capacity;
+  double *prob;  // Chance of keeping index i rather than taking alias[i]
+  u32 *alias;
+  u32 *work;     // Scratch for building: small and large indices
+};
+
+struct alias_table *alias_table_create(void) {
+  return (struct alias_table *)ck_alloc(sizeof(struct alias_table));
+}
+
+void alias_table_free(struct alias_table *at) {
+  ck_free(at->prob);
+  ck_free(at->alias);
+  ck_free(at->work);
+  ck_free(at);
+}
+
+// Rebuild the table for n weights. The weights are scaled in place; if they
+// are all zero, every index gets the same chance.
+void alias_table_build(struct alias_table *at, double *weights, u32 n) {
+  double total = 0.0;
+  u32 i, n_small = 0, n_large = 0;
+  u32 *small, *large;
+
+  if (n > at->capacity) {
+    at->capacity = n * 2;
+    at->prob = ck_realloc(at->prob, at->capacity * sizeof(double));
+    at->alias = ck_realloc(at->alias, at->capacity * sizeof(u32));
+    at->work = ck_realloc(at->work, at->capacity * sizeof(u32));
+  }
+  at->size = n;
+  if (!n) return;
+
+  for (i = 0; i < n; i++) total += weights[i];
+
+  small = at->work;
+  large = at->work + n - 1;  // Grows downwards; the two never overlap
+
+  for (i = 0; i < n; i++) {
+    weights[i] = total > 0.0 ? weights[i] * n / total : 1.0;
+    if (weights[i] < 1.0) small[n_small++] = i;
+    else *(large - n_large++) = i;
+  }
+
+  while (n_small && n_large) {
+    u32 s = small[--n_small], l = *(large - --n_large);
+    at->prob[s] = weights[s];
+    at->alias[s] = l;
+    weights[l] -= 1.0 - weights[s];
+    if (weights[l] < 1.0) small[n_small++] = l;
+    else *(large - n_large++) = l;
+  }
+
+  // Whatever is left is 1.0, give or take rounding.
+  while (n_large) {
+    u32 l = *(large - --n_large);
+    at->prob[l] = 1.0;
+    at->alias[l] = l;
+  }
+  while (n_small) {
+    u32 s = small[--n_small];
+    at->prob[s] = 1.0;
+    at->alias[s] = s;
+  }
+}
+
+u32 alias_table_sample(struct alias_table *at) {
+  u32 i = rand() % at->size;
+  return (double)rand() / RAND_MAX < at->prob[i] ? i : at->alias[i];
+}
+
+// Hashmap: open addressing with Robin Hood probing. Entries live in one flat
+// array; a pointer returned by hashmap_get() is only good until the next
+// insert or remove.
 struct key_value_pair {
   u32 key;
+  u32 dist;     // Probe distance + 1; 0 marks an empty slot
   void* value;
-  struct key_value_pair* next;
 };
 
 struct hashmap {
   u32 size;
-  u32 table_size;
-  struct key_value_pair** table;
+  u32 table_size; // Always a power of two
+  u32 shift;      // 32 - log2(table_size)
+  struct key_value_pair* table;
 };
 
 struct hashmap* hashmap_create(u32 table_size) {
   struct hashmap* map = (struct hashmap *)ck_alloc(sizeof(struct hashmap));
-  if (map == NULL) {
-    printf("Memory allocation failed.\n");
-    exit(EXIT_FAILURE);
+  u32 n = 16, shift = 28;
+  while (n < table_size) {
+    n <<= 1;
+    shift--;
   }
   map->size = 0;
-  map->table_size = table_size;
-  map->table = (struct key_value_pair**)ck_alloc(table_size * sizeof(struct key_value_pair*));
-  if (map->table == NULL) {
-    printf("Memory allocation failed.\n");
-    exit(EXIT_FAILURE);
-  }
-  for (u32 i = 0; i < table_size; i++) {
-    map->table[i] = NULL;
-  }
+  map->table_size = n;
+  map->shift = shift;
+  map->table = (struct key_value_pair*)ck_alloc(n * sizeof(struct key_value_pair));
   return map;
 }
 
-static u32 hashmap_fit(u32 key, u32 table_size) {
-  return key % table_size;
+// Keys are often small integers or already hashes; Fibonacci hashing
+// spreads both over the table by taking the top bits of key * 2^32 / phi.
+static inline u32 hashmap_fit(struct hashmap *map, u32 key) {
+  return (key * 0x9e3779b9U) >> map->shift;
+}
+
+// Put key where it belongs, or replace its value if it is there already.
+// Returns 1 if the key is new.
+static u8 hashmap_place(struct hashmap *map, u32 key, void* value) {
+  u32 mask = map->table_size - 1;
+  u32 index = hashmap_fit(map, key);
+  struct key_value_pair cur = { key, 1, value };
+  while (1) {
+    struct key_value_pair *slot = &map->table[index];
+    if (!slot->dist) {
+      *slot = cur;
+      return 1;
+    }
+    if (slot->dist == cur.dist && slot->key == cur.key) {
+      slot->value = cur.value;
+      return 0;
+    }
+    // Take from the rich: whoever is closer to home moves on. From here on,
+    // cur is an entry that was already in the table.
+    if (slot->dist < cur.dist) {
+      struct key_value_pair tmp = *slot;
+      *slot = cur;
+      cur = tmp;
+      while (1) {
+        cur.dist++;
+        index = (index + 1) & mask;
+        slot = &map->table[index];
+        if (!slot->dist) {
+          *slot = cur;
+          return 1;
+        }
+        if (slot->dist < cur.dist) {
+          tmp = *slot;
+          *slot = cur;
+          cur = tmp;
+        }
+      }
+    }
+    cur.dist++;
+    index = (index + 1) & mask;
+  }
 }
 
 static void hashmap_resize(struct hashmap *map) {
 
-  u32 new_table_size = map->table_size * 2;
-  struct key_value_pair **new_table = (struct key_value_pair**)ck_alloc(new_table_size * sizeof(struct key_value_pair*));
-  if (new_table == NULL) {
-    printf("Memory allocation failed.\n");
-    exit(EXIT_FAILURE);
-  }
-  for (int i = 0; i < map->table_size; i++) {
-    struct key_value_pair* pair = map->table[i];
-    while (pair != NULL) {
-      struct key_value_pair *next = pair->next;
-      u32 index = hashmap_fit(pair->key, new_table_size);
-      pair->next = new_table[index];
-      new_table[index] = pair;
-      pair = next;
+  struct key_value_pair *old_table = map->table;
+  u32 old_size = map->table_size;
+
+  map->table_size = old_size * 2;
+  map->shift--;
+  map->table = (struct key_value_pair*)ck_alloc(map->table_size * sizeof(struct key_value_pair));
+  for (u32 i = 0; i < old_size; i++) {
+    if (old_table[i].dist) {
+      hashmap_place(map, old_table[i].key, old_table[i].value);
     }
   }
-  ck_free(map->table);
-  map->table = new_table;
-  map->table_size = new_table_size;
+  ck_free(old_table);
 
 }
 
@@ -720,65 +996,49 @@ u32 hashmap_size(struct hashmap* map) {
   return map->size;
 }
 
-// Function to insert a key-value pair into the hash map
-void hashmap_insert(struct hashmap* map, u32 key, void* value) {
-  u32 index = hashmap_fit(key, map->table_size);
-  struct key_value_pair* newPair = (struct key_value_pair*)ck_alloc(sizeof(struct key_value_pair));
-  if (newPair == NULL) {
-    printf("Memory allocation failed.\n");
-    exit(EXIT_FAILURE);
-  }
-  newPair->key = key;
-  newPair->value = value;
-  newPair->next = map->table[index];
-  map->table[index] = newPair;
-  map->size++;
-  if (map->size > map->table_size / 2) {
-    hashmap_resize(map);
+struct key_value_pair* hashmap_get(struct hashmap* map, u32 key) {
+  u32 mask = map->table_size - 1;
+  u32 index = hashmap_fit(map, key);
+  u32 dist = 1;
+  while (1) {
+    struct key_value_pair *slot = &map->table[index];
+    // Robin Hood invariant: the key would have been placed by now.
+    if (slot->dist < dist) return NULL;
+    if (slot->key == key) return slot;
+    dist++;
+    index = (index + 1) & mask;
   }
 }
 
-void hashmap_remove(struct hashmap *map, u32 key) {
-  u32 index = hashmap_fit(key, map->table_size);
-  struct key_value_pair* pair = map->table[index];
-  struct key_value_pair* prev = NULL;
-  while (pair != NULL) {
-    if (pair->key == key) {
-      if (!prev) {
-        map->table[index] = pair->next;
-      } else {
-        prev->next = pair->next;
-      }
-      map->size--;
-      ck_free(pair);
-      return;
-    }
-    prev = pair;
-    pair = pair->next;
+// Function to insert a key-value pair into the hash map. Inserting a key
+// that is already there replaces its value.
+void hashmap_insert(struct hashmap* map, u32 key, void* value) {
+  // Keep the load factor at or under 1/2; probe sequences stay short.
+  if ((map->size + 1) * 2 > map->table_size) {
+    hashmap_resize(map);
   }
+  map->size += hashmap_place(map, key, value);
 }
 
-struct key_value_pair* hashmap_get(struct hashmap* map, u32 key) {
-  u32 index = hashmap_fit(key, map->table_size);
-  struct key_value_pair* pair = map->table[index];
-  while (pair != NULL) {
-    if (pair->key == key) {
-      return pair;
-    }
-    pair = pair->next;
+void hashmap_remove(struct hashmap *map, u32 key) {
+  u32 mask = map->table_size - 1;
+  struct key_value_pair *pair = hashmap_get(map, key);
+  u32 index;
+  if (!pair) return;
+  // Backward shift: pull the following displaced entries one slot closer.
+  index = pair - map->table;
+  while (1) {
+    u32 next = (index + 1) & mask;
+    if (map->table[next].dist <= 1) break;
+    map->table[index] = map->table[next];
+    map->table[index].dist--;
+    index = next;
   }
-  return NULL;
+  map->table[index].dist = 0;
+  map->size--;
 }
 
 void hashmap_free(struct hashmap* map) {
-  for (u32 i = 0; i < map->table_size; i++) {
-    struct key_value_pair* pair = map->table[i];
-    while (pair != NULL) {
-      struct key_value_pair* next = pair->next;
-      ck_free(pair);
-      pair = next;
-    }
-  }
   ck_free(map->table);
   ck_free(map);
 }
@@ -790,6 +1050,8 @@ struct cluster {
   struct list *cluster_nodes; // list<struct cluster_node*>
   struct list_entry *cur;
   struct list_entry *first_unhandled;
+  struct list_entry *unhandled; // No unhandled entry before this one...
+  u32 unhandled_epoch;          // ...as of this cycle
 };
 
 struct cluster_node {
@@ -833,17 +1095,29 @@ u32 cluster_size(struct cluster *cluster) {
   return list_size(cluster->cluster_nodes);
 }
 
+/**
+ * First entry of the cluster not handled in the current cycle, or NULL.
+ * The cursor only moves forward within a cycle and restarts at the head in
+ * the next one, so each entry is skipped at most once per cycle.
+ */
+struct list_entry *cluster_first_unhandled(struct cluster *cluster) {
+  if (cluster->unhandled_epoch != sched_idx.epoch) {
+    cluster->unhandled = list_get_head(cluster->cluster_nodes);
+    cluster->unhandled_epoch = sched_idx.epoch;
+  }
+  while (cluster->unhandled && sched_handled((struct queue_entry *)cluster->unhandled->data))
+    cluster->unhandled = cluster->unhandled->next;
+  return cluster->unhandled;
+}
+
 //Adds a queue_entry to the cluster in a sorted manner.
 u32 cluster_add_child(struct cluster *cluster, struct queue_entry *entry) {
   if (!cluster || !entry) return 0; 
   // sorted insertion: larger ones go to the front
   struct list_entry *entry_node = list_get_head(cluster->cluster_nodes);
   struct list_entry *last_added_entry = NULL;
-  cluster->first_unhandled = NULL;
   while (entry_node) {
     struct queue_entry *cur_entry = (struct queue_entry*)entry_node->data;
-    if (!cluster->first_unhandled && !cur_entry->handled_in_cycle)
-      cluster->first_unhandled = entry_node;
     if (cur_entry->prox_score <= entry->prox_score) {
       last_added_entry = list_insert_left(cluster->cluster_nodes, entry_node, entry);
       break;
@@ -853,9 +1127,14 @@ u32 cluster_add_child(struct cluster *cluster, struct queue_entry *entry) {
   // If the entry is the smallest (or list is empty), add it to the end
   if (!last_added_entry)
     last_added_entry = list_insert_back(cluster->cluster_nodes, entry);
+  entry->cluster = cluster;
   // print_list(cluster->id, cluster->cluster_nodes);
-  if (!cluster->first_unhandled)
-    cluster->first_unhandled = last_added_entry;
+  // The new entry is unhandled; pull the cursor back if it went in before it.
+  if (cluster->unhandled_epoch == sched_idx.epoch &&
+      (!cluster->unhandled ||
+       ((struct queue_entry *)cluster->unhandled->data)->prox_score <= entry->prox_score))
+    cluster->unhandled = last_added_entry;
+  cluster->first_unhandled = cluster_first_unhandled(cluster);
   return 1;
 }
 
@@ -866,7 +1145,11 @@ u8 cluster_remove_child(struct cluster *cluster, struct queue_entry *entry) {
 
   struct list_entry *entry_node = list_get(cluster->cluster_nodes, entry);
   if (entry_node) {
+    if (cluster->unhandled == entry_node) cluster->unhandled = entry_node->next;
+    if (cluster->cur == entry_node) cluster->cur = entry_node->next;
+    if (cluster->first_unhandled == entry_node) cluster->first_unhandled = NULL;
     list_remove(cluster->cluster_nodes, entry_node);
+    if (entry->cluster == cluster) entry->cluster = NULL;
     return 1;
   }
 
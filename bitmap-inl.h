@@ -0,0 +1,656 @@
+/*
+   american fuzzy lop - coverage bitmap kernels
+   --------------------------------------------
+
+   The routines that sweep the whole MAP_SIZE coverage bitmap after every
+   exec (has_new_bits(), classify_counts(), ...), in a portable scalar
+   flavor plus AVX2 and AVX-512 variants for x86. The vector variants are
+   compiled with per-function target attributes, so no special compiler
+   flags are needed; select_bitmap_kernels() picks the best set supported
+   by the CPU at startup.
+
+   All variants take plain pointers to MAP_SIZE-byte maps. The vector code
+   uses unaligned loads, so heap copies of the trace are fine, too.
+
+   The scalar code is the original one from afl-fuzz.c. Results must stay
+   identical across variants - experimental/bitmap_bench/ checks
+   that, too.
+*/
+
+#ifndef _HAVE_BITMAP_INL_H
+#define _HAVE_BITMAP_INL_H
+
+#include <stdlib.h>
+
+#include "config.h"
+#include "types.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define HAVE_BITMAP_SIMD 1
+#  include <immintrin.h>
+#endif /* __x86_64__ */
+
+
+/* Set of kernels; see the scalar versions for what each one does. */
+
+struct bitmap_kernels {
+
+  const char* name;                   /* Shown in the startup banner      */
+
+  u8   (*has_new_bits)(u8* trace, u8* virgin);
+  void (*classify_counts)(u8* mem);
+  void (*simplify_trace)(u8* mem);
+  u32  (*count_bytes)(u8* mem);
+  u32  (*count_non_255_bytes)(u8* mem);
+
+};
+
+
+/* Lookup tables shared by the scalar kernels. */
+
+static const u8 simplify_lookup[256] = {
+
+  [0]         = 1,
+  [1 ... 255] = 128
+
+};
+
+static const u8 count_class_lookup8[256] = {
+
+  [0]           = 0,
+  [1]           = 1,
+  [2]           = 2,
+  [3]           = 4,
+  [4 ... 7]     = 8,
+  [8 ... 15]    = 16,
+  [16 ... 31]   = 32,
+  [32 ... 127]  = 64,
+  [128 ... 255] = 128
+
+};
+
+static u16 count_class_lookup16[65536];
+
+
+static void init_count_class16(void) {
+
+  u32 b1, b2;
+
+  for (b1 = 0; b1 < 256; b1++)
+    for (b2 = 0; b2 < 256; b2++)
+      count_class_lookup16[(b1 << 8) + b2] =
+        (count_class_lookup8[b1] << 8) |
+        count_class_lookup8[b2];
+
+}
+
+
+/* Check if the trace brings anything new to the table. Update the virgin
+   map to reflect the finds. Returns 1 if the only change is the hit-count
+   for a particular tuple; 2 if there are new tuples seen. Updates the map,
+   so subsequent calls will always return 0. */
+
+static u8 has_new_bits_scalar(u8* trace, u8* virgin_map) {
+
+#ifdef WORD_SIZE_64
+
+  u64* current = (u64*)trace;
+  u64* virgin  = (u64*)virgin_map;
+
+  u32  i = (MAP_SIZE >> 3);
+
+#else
+
+  u32* current = (u32*)trace;
+  u32* virgin  = (u32*)virgin_map;
+
+  u32  i = (MAP_SIZE >> 2);
+
+#endif /* ^WORD_SIZE_64 */
+
+  u8   ret = 0;
+
+  while (i--) {
+
+    /* Optimize for (*current & *virgin) == 0 - i.e., no bits in current bitmap
+       that have not been already cleared from the virgin map - since this will
+       almost always be the case. */
+
+    if (unlikely(*current) && unlikely(*current & *virgin)) {
+
+      if (likely(ret < 2)) {
+
+        u8* cur = (u8*)current;
+        u8* vir = (u8*)virgin;
+
+        /* Looks like we have not found any new bytes yet; see if any non-zero
+           bytes in current[] are pristine in virgin[]. */
+
+#ifdef WORD_SIZE_64
+
+        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
+            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff) ||
+            (cur[4] && vir[4] == 0xff) || (cur[5] && vir[5] == 0xff) ||
+            (cur[6] && vir[6] == 0xff) || (cur[7] && vir[7] == 0xff)) ret = 2;
+        else ret = 1;
+
+#else
+
+        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
+            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff)) ret = 2;
+        else ret = 1;
+
+#endif /* ^WORD_SIZE_64 */
+
+      }
+
+      *virgin &= ~*current;
+
+    }
+
+    current++;
+    virgin++;
+
+  }
+
+  return ret;
+
+}
+
+
+/* Destructively classify execution counts in a trace. */
+
+static void classify_counts_scalar(u8* mem8) {
+
+#ifdef WORD_SIZE_64
+
+  u64* mem = (u64*)mem8;
+  u32  i   = MAP_SIZE >> 3;
+
+  while (i--) {
+
+    /* Optimize for sparse bitmaps. */
+
+    if (unlikely(*mem)) {
+
+      u16* mem16 = (u16*)mem;
+
+      mem16[0] = count_class_lookup16[mem16[0]];
+      mem16[1] = count_class_lookup16[mem16[1]];
+      mem16[2] = count_class_lookup16[mem16[2]];
+      mem16[3] = count_class_lookup16[mem16[3]];
+
+    }
+
+    mem++;
+
+  }
+
+#else
+
+  u32* mem = (u32*)mem8;
+  u32  i   = MAP_SIZE >> 2;
+
+  while (i--) {
+
+    /* Optimize for sparse bitmaps. */
+
+    if (unlikely(*mem)) {
+
+      u16* mem16 = (u16*)mem;
+
+      mem16[0] = count_class_lookup16[mem16[0]];
+      mem16[1] = count_class_lookup16[mem16[1]];
+
+    }
+
+    mem++;
+
+  }
+
+#endif /* ^WORD_SIZE_64 */
+
+}
+
+
+/* Destructively simplify trace by eliminating hit count information
+   and replacing it with 0x80 or 0x01 depending on whether the tuple
+   is hit or not. */
+
+static void simplify_trace_scalar(u8* mem8) {
+
+#ifdef WORD_SIZE_64
+
+  u64* mem = (u64*)mem8;
+  u32  i   = MAP_SIZE >> 3;
+
+  while (i--) {
+
+    /* Optimize for sparse bitmaps. */
+
+    if (unlikely(*mem)) {
+
+      u8* mem8 = (u8*)mem;
+
+      mem8[0] = simplify_lookup[mem8[0]];
+      mem8[1] = simplify_lookup[mem8[1]];
+      mem8[2] = simplify_lookup[mem8[2]];
+      mem8[3] = simplify_lookup[mem8[3]];
+      mem8[4] = simplify_lookup[mem8[4]];
+      mem8[5] = simplify_lookup[mem8[5]];
+      mem8[6] = simplify_lookup[mem8[6]];
+      mem8[7] = simplify_lookup[mem8[7]];
+
+    } else *mem = 0x0101010101010101ULL;
+
+    mem++;
+
+  }
+
+#else
+
+  u32* mem = (u32*)mem8;
+  u32  i   = MAP_SIZE >> 2;
+
+  while (i--) {
+
+    /* Optimize for sparse bitmaps. */
+
+    if (unlikely(*mem)) {
+
+      u8* mem8 = (u8*)mem;
+
+      mem8[0] = simplify_lookup[mem8[0]];
+      mem8[1] = simplify_lookup[mem8[1]];
+      mem8[2] = simplify_lookup[mem8[2]];
+      mem8[3] = simplify_lookup[mem8[3]];
+
+    } else *mem = 0x01010101;
+
+    mem++;
+  }
+
+#endif /* ^WORD_SIZE_64 */
+
+}
+
+
+#define FF(_b)  (0xff << ((_b) << 3))
+
+/* Count the number of bytes set in the bitmap. */
+
+static u32 count_bytes_scalar(u8* mem) {
+
+  u32* ptr = (u32*)mem;
+  u32  i   = (MAP_SIZE >> 2);
+  u32  ret = 0;
+
+  while (i--) {
+
+    u32 v = *(ptr++);
+
+    if (!v) continue;
+    if (v & FF(0)) ret++;
+    if (v & FF(1)) ret++;
+    if (v & FF(2)) ret++;
+    if (v & FF(3)) ret++;
+
+  }
+
+  return ret;
+
+}
+
+
+/* Count the number of non-255 bytes set in the bitmap. */
+
+static u32 count_non_255_bytes_scalar(u8* mem) {
+
+  u32* ptr = (u32*)mem;
+  u32  i   = (MAP_SIZE >> 2);
+  u32  ret = 0;
+
+  while (i--) {
+
+    u32 v = *(ptr++);
+
+    /* This is called on the virgin bitmap, so optimize for the most likely
+       case. */
+
+    if (v == 0xffffffff) continue;
+    if ((v & FF(0)) != FF(0)) ret++;
+    if ((v & FF(1)) != FF(1)) ret++;
+    if ((v & FF(2)) != FF(2)) ret++;
+    if ((v & FF(3)) != FF(3)) ret++;
+
+  }
+
+  return ret;
+
+}
+
+
+static const struct bitmap_kernels bitmap_kernels_scalar = {
+
+  "scalar",
+  has_new_bits_scalar,
+  classify_counts_scalar,
+  simplify_trace_scalar,
+  count_bytes_scalar,
+  count_non_255_bytes_scalar
+
+};
+
+
+#ifdef HAVE_BITMAP_SIMD
+
+/* Hit count classes, looked up by nibble with pshufb. A byte with a non-zero
+   high nibble always lands in a class of 32 or more, while the low nibble
+   alone never gets past 16 - so the class of the whole byte is simply the
+   larger of the two lookups. */
+
+#define CLASS_LO_NIBBLE 0, 1, 2, 4, 8, 8, 8, 8, \
+                        16, 16, 16, 16, 16, 16, 16, 16
+#define CLASS_HI_NIBBLE 0, 32, 64, 64, 64, 64, 64, 64, \
+                        128, 128, 128, 128, 128, 128, 128, 128
+
+/* AVX2 variants, 32 bytes at a time. */
+
+__attribute__((target("avx2")))
+static u8 has_new_bits_avx2(u8* trace, u8* virgin) {
+
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi8(-1);
+
+  u32 i;
+  u8  ret = 0;
+
+  for (i = 0; i < MAP_SIZE; i += 32) {
+
+    __m256i c = _mm256_loadu_si256((__m256i*)(trace + i));
+    __m256i v = _mm256_loadu_si256((__m256i*)(virgin + i));
+
+    if (likely(_mm256_testz_si256(c, v))) continue;
+
+    if (likely(ret < 2)) {
+
+      /* Any non-zero byte in the trace that is still pristine in virgin? */
+
+      __m256i hit   = _mm256_andnot_si256(_mm256_cmpeq_epi8(c, zero), ones);
+      __m256i fresh = _mm256_and_si256(hit, _mm256_cmpeq_epi8(v, ones));
+
+      ret = _mm256_testz_si256(fresh, fresh) ? 1 : 2;
+
+    }
+
+    _mm256_storeu_si256((__m256i*)(virgin + i), _mm256_andnot_si256(c, v));
+
+  }
+
+  return ret;
+
+}
+
+
+__attribute__((target("avx2")))
+static void classify_counts_avx2(u8* mem) {
+
+  const __m256i lo_lut = _mm256_setr_epi8(CLASS_LO_NIBBLE, CLASS_LO_NIBBLE);
+  const __m256i hi_lut = _mm256_setr_epi8(CLASS_HI_NIBBLE, CLASS_HI_NIBBLE);
+  const __m256i nib    = _mm256_set1_epi8(0x0f);
+
+  u32 i;
+
+  for (i = 0; i < MAP_SIZE; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+    __m256i lo, hi;
+
+    /* Optimize for sparse bitmaps. */
+
+    if (likely(_mm256_testz_si256(v, v))) continue;
+
+    lo = _mm256_shuffle_epi8(lo_lut, _mm256_and_si256(v, nib));
+    hi = _mm256_shuffle_epi8(hi_lut,
+                             _mm256_and_si256(_mm256_srli_epi16(v, 4), nib));
+
+    _mm256_storeu_si256((__m256i*)(mem + i), _mm256_max_epu8(lo, hi));
+
+  }
+
+}
+
+
+__attribute__((target("avx2")))
+static void simplify_trace_avx2(u8* mem) {
+
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i miss = _mm256_set1_epi8(1);
+  const __m256i hit  = _mm256_set1_epi8((char)128);
+
+  u32 i;
+
+  for (i = 0; i < MAP_SIZE; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+
+    _mm256_storeu_si256((__m256i*)(mem + i),
+                       _mm256_blendv_epi8(hit, miss, _mm256_cmpeq_epi8(v, zero)));
+
+  }
+
+}
+
+
+__attribute__((target("avx2,popcnt")))
+static u32 count_bytes_avx2(u8* mem) {
+
+  const __m256i zero = _mm256_setzero_si256();
+
+  u32 i, ret = 0;
+
+  for (i = 0; i < MAP_SIZE; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+
+    if (likely(_mm256_testz_si256(v, v))) continue;
+
+    ret += 32 - _mm_popcnt_u32(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)));
+
+  }
+
+  return ret;
+
+}
+
+
+__attribute__((target("avx2,popcnt")))
+static u32 count_non_255_bytes_avx2(u8* mem) {
+
+  const __m256i ones = _mm256_set1_epi8(-1);
+
+  u32 i, ret = 0;
+
+  for (i = 0; i < MAP_SIZE; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+
+    if (likely(_mm256_testc_si256(v, ones))) continue;
+
+    ret += 32 - _mm_popcnt_u32(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones)));
+
+  }
+
+  return ret;
+
+}
+
+
+static const struct bitmap_kernels bitmap_kernels_avx2 = {
+
+  "avx2",
+  has_new_bits_avx2,
+  classify_counts_avx2,
+  simplify_trace_avx2,
+  count_bytes_avx2,
+  count_non_255_bytes_avx2
+
+};
+
+
+/* AVX-512 variants, 64 bytes at a time. Byte-granular masks need BW. */
+
+__attribute__((target("avx512f,avx512bw")))
+static u8 has_new_bits_avx512(u8* trace, u8* virgin) {
+
+  const __m512i ones = _mm512_set1_epi8(-1);
+
+  u32 i;
+  u8  ret = 0;
+
+  for (i = 0; i < MAP_SIZE; i += 64) {
+
+    __m512i c = _mm512_loadu_si512((__m512i*)(trace + i));
+    __m512i v = _mm512_loadu_si512((__m512i*)(virgin + i));
+
+    if (likely(!_mm512_test_epi64_mask(c, v))) continue;
+
+    if (likely(ret < 2))
+      ret = (_mm512_test_epi8_mask(c, c) & _mm512_cmpeq_epi8_mask(v, ones)) ?
+            2 : 1;
+
+    _mm512_storeu_si512((__m512i*)(virgin + i), _mm512_andnot_si512(c, v));
+
+  }
+
+  return ret;
+
+}
+
+
+__attribute__((target("avx512f,avx512bw")))
+static void classify_counts_avx512(u8* mem) {
+
+  const __m512i lo_lut = _mm512_broadcast_i32x4(_mm_setr_epi8(CLASS_LO_NIBBLE));
+  const __m512i hi_lut = _mm512_broadcast_i32x4(_mm_setr_epi8(CLASS_HI_NIBBLE));
+  const __m512i nib    = _mm512_set1_epi8(0x0f);
+
+  u32 i;
+
+  for (i = 0; i < MAP_SIZE; i += 64) {
+
+    __m512i v = _mm512_loadu_si512((__m512i*)(mem + i));
+    __m512i lo, hi;
+
+    /* Optimize for sparse bitmaps. */
+
+    if (likely(!_mm512_test_epi64_mask(v, v))) continue;
+
+    lo = _mm512_shuffle_epi8(lo_lut, _mm512_and_si512(v, nib));
+    hi = _mm512_shuffle_epi8(hi_lut,
+                             _mm512_and_si512(_mm512_srli_epi16(v, 4), nib));
+
+    _mm512_storeu_si512((__m512i*)(mem + i), _mm512_max_epu8(lo, hi));
+
+  }
+
+}
+
+
+__attribute__((target("avx512f,avx512bw")))
+static void simplify_trace_avx512(u8* mem) {
+
+  const __m512i miss = _mm512_set1_epi8(1);
+  const __m512i hit  = _mm512_set1_epi8((char)128);
+
+  u32 i;
+
+  for (i = 0; i < MAP_SIZE; i += 64) {
+
+    __m512i v = _mm512_loadu_si512((__m512i*)(mem + i));
+
+    _mm512_storeu_si512((__m512i*)(mem + i),
+                       _mm512_mask_blend_epi8(_mm512_test_epi8_mask(v, v),
+                                              miss, hit));
+
+  }
+
+}
+
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static u32 count_bytes_avx512(u8* mem) {
+
+  u32 i, ret = 0;
+
+  for (i = 0; i < MAP_SIZE; i += 64) {
+
+    __m512i v = _mm512_loadu_si512((__m512i*)(mem + i));
+
+    ret += _mm_popcnt_u64(_mm512_test_epi8_mask(v, v));
+
+  }
+
+  return ret;
+
+}
+
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static u32 count_non_255_bytes_avx512(u8* mem) {
+
+  const __m512i ones = _mm512_set1_epi8(-1);
+
+  u32 i, ret = 0;
+
+  for (i = 0; i < MAP_SIZE; i += 64) {
+
+    __m512i v = _mm512_loadu_si512((__m512i*)(mem + i));
+
+    ret += _mm_popcnt_u64(_mm512_cmpneq_epi8_mask(v, ones));
+
+  }
+
+  return ret;
+
+}
+
+
+static const struct bitmap_kernels bitmap_kernels_avx512 = {
+
+  "avx512",
+  has_new_bits_avx512,
+  classify_counts_avx512,
+  simplify_trace_avx512,
+  count_bytes_avx512,
+  count_non_255_bytes_avx512
+
+};
+
+#endif /* HAVE_BITMAP_SIMD */
+
+
+/* Pick the fastest set of kernels the CPU can run. Setting AFL_NO_SIMD
+   forces the scalar ones. */
+
+static const struct bitmap_kernels* select_bitmap_kernels(void) {
+
+  if (getenv("AFL_NO_SIMD")) return &bitmap_kernels_scalar;
+
+#ifdef HAVE_BITMAP_SIMD
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    return &bitmap_kernels_avx512;
+
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    return &bitmap_kernels_avx2;
+
+#endif /* HAVE_BITMAP_SIMD */
+
+  return &bitmap_kernels_scalar;
+
+}
+
+#endif /* !_HAVE_BITMAP_INL_H */
@@ -8,6 +8,7 @@ import sbsv
 import pickle
 import time
 import sys
+import struct
 
 
 def read_result(filename: str) -> dict:
@@ -33,6 +34,42 @@ def read_result(filename: str) -> dict:
     
     return vectors
 
+DFG_VEC_MAGIC=0x56474644 # "DFGV"
+
+def unpack_vectors(data:bytes, off:int, count:int, dim:int):
+    """
+        Parse count sparse DFG vector records starting at data[off:], as
+        written by afl-fuzz: u32 input hash, u32 entry id, u32 number of
+        non-zero counters, then that many packed (u32 index, u64 value).
+        count=-1 reads to the end of data.
+
+        Returns:
+            (List[Tuple[int,int,List[int]]], int) - (hash, entry id, dense vector) per record, and the offset past them
+    """
+    records=[]
+    while count!=0 and off<len(data):
+        file_hash,entry_id,nnz=struct.unpack_from('<III',data,off)
+        off+=12
+        vec=[0]*dim
+        for i,v in struct.iter_unpack('<IQ',data[off:off+12*nnz]):
+            vec[i]=v
+        off+=12*nnz
+        records.append((file_hash,entry_id,vec))
+        count-=1
+    return records,off
+
+def read_vectors(filename: str) -> dict:
+    """
+        Read out_dir/dfg_vectors.bin; same result as read_result() on dry_run_results.sbsv.
+    """
+    with open(filename,'rb') as f:
+        data=f.read()
+    magic,dim=struct.unpack_from('<II',data,0)
+    if magic!=DFG_VEC_MAGIC:
+        raise ValueError(f'{filename}: not a DFG vector file')
+    records,_=unpack_vectors(data,8,-1,dim)
+    return {file_hash:vec for file_hash,_,vec in records}
+
 def save_clusters(clusters:Dict[str,int], path:str):
     if path == "":
         for name,cluster in clusters.items():
@@ -144,6 +181,37 @@ def bisecting_kmeans(vectors:Dict[str, List[int]], k:int=-1):
         save_sklearn_model(kmeans,f'{args.workdir}/bisecting-kmeans.pkl')
     return {name:cluster for name,cluster in zip(vectors.keys(),res)}
 
+def serve(model_path:str):
+    """
+        Assign clusters with a fitted model for afl-fuzz, over stdin/stdout.
+        The model is loaded once; requests are answered until stdin closes.
+
+        Request: u32 count, u32 dim, then count sparse DFG vector records (see unpack_vectors)
+        Reply: count times (u32 entry id, u32 cluster id)
+    """
+    with open(model_path,'rb') as f:
+        model=pickle.load(f)
+    inp=sys.stdin.buffer
+    out=sys.stdout.buffer
+    while True:
+        hdr=inp.read(8)
+        if len(hdr)<8:
+            break
+        count,dim=struct.unpack('<II',hdr)
+        records=[]
+        for _ in range(count):
+            rec=inp.read(12)
+            if len(rec)<12:
+                return
+            size=12+12*struct.unpack_from('<I',rec,8)[0]
+            rec+=inp.read(size-12)
+            if len(rec)<size:
+                return
+            records+=unpack_vectors(rec,0,1,dim)[0]
+        res=model.predict([vec for _,_,vec in records]) if records else []
+        out.write(b''.join(struct.pack('<II',entry_id,int(c)) for (_,entry_id,_),c in zip(records,res)))
+        out.flush()
+
 if __name__=='__main__':
     start = time.time()
     arg_parser = argparse.ArgumentParser()
@@ -152,9 +220,17 @@ if __name__=='__main__':
     arg_parser.add_argument('workdir', action='store', type=str, help='Path to the working directory')
     arg_parser.add_argument('-k', '--k', action='store', type=int, help='Number of clusters', default=-1)
     arg_parser.add_argument('-o', '--output', action='store', type=str, help='Path to the output file', default="")
+    arg_parser.add_argument('--serve', action='store_true', help='Serve assignments with the fitted model on stdin/stdout (vector_path is ignored)')
     args = arg_parser.parse_args()
 
-    vectors=read_result(args.vector_path)
+    if args.serve:
+        serve(f'{args.workdir}/{args.cluster}.pkl')
+        sys.exit(0)
+
+    if args.vector_path.endswith('.bin'):
+        vectors=read_vectors(args.vector_path)
+    else:
+        vectors=read_result(args.vector_path)
 
     if args.cluster=='kmeans':
         clusters=kmeans(vectors,args.k)
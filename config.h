@@ -50,6 +50,41 @@
 
 #define EXEC_TIMEOUT        1000
 
+/* Default timeout for the valuation binary (PACFIX_VAL_EXE), in
+   milliseconds; PACFIX_VAL_TMOUT overrides it: */
+
+#define VAL_EXEC_TIMEOUT    10000
+
+/* Upper limit for PACFIX_VAL_WORKERS, and the number of target-reaching
+   inputs that may wait for a free valuation worker before the fuzzer stops
+   to wait for one: */
+
+#define VAL_WORKERS_MAX     16
+#define VAL_QUEUE_SIZE      64
+
+/* In-process k-means for -s cluster: range of cluster counts tried on the
+   dry-run DFG vectors (the best silhouette score wins), Lloyd iterations
+   and k-means++ restarts per fit, and the largest number of vectors the
+   silhouette score is computed on: */
+
+#define KMEANS_K_MIN        2
+#define KMEANS_K_MAX        10
+#define KMEANS_MAX_ITER     300
+#define KMEANS_RESTARTS     4
+#define KMEANS_SIL_SAMPLE   1000
+
+/* New entries wait in a cluster of their own until CLUSTER_BATCH_SIZE of
+   them have gathered, or for CLUSTER_BATCH_TIME seconds, and are then
+   classified together: */
+
+#define CLUSTER_BATCH_SIZE  32
+#define CLUSTER_BATCH_TIME  5
+
+/* Entries checked per main loop iteration for a closer centroid, with
+   AFL_CLUSTER_ONLINE: */
+
+#define CLUSTER_REBALANCE_STEP 16
+
 /* Timeout rounding factor when auto-scaling (milliseconds): */
 
 #define EXEC_TM_ROUND       20
@@ -153,6 +188,25 @@
 
 #define MAX_FILE            (1 * 1024 * 1024)
 
+/* Window in which the packed seed store (AFL_SEED_STORE) is mapped; a
+   single test case never straddles two windows, so this must be well above
+   MAX_FILE and a multiple of the page size: */
+
+#define SEED_STORE_WINDOW   (256 * 1024 * 1024)
+
+/* Magic at the start of out_dir/dfg_vectors.bin, the sparse DFG vectors of
+   the dry run: */
+
+#define DFG_VEC_MAGIC       0x56474644 /* "DFGV" */
+
+/* Size of the scratch arena for short-lived file names and log fields: */
+
+#define SCRATCH_SIZE        (64 * 1024)
+
+/* Number of recently fuzzed test cases that are kept mapped: */
+
+#define SEED_CACHE_SIZE     32
+
 /* The same, for the test case minimizer: */
 
 #define TMIN_MAX_FILE       (10 * 1024 * 1024)
@@ -279,6 +333,13 @@
 #define SHM_ENV_VAR         "__AFL_SHM_ID"
 #define SHM_ENV_VAR_DFG     "__AFL_SHM_ID_DFG"
 #define SHM_ENV_VAR_HIT     "__AFL_SHM_ID_HIT"
+#define SHM_ENV_VAR_FUZZ    "__AFL_SHM_ID_FUZZ"
+#define SHM_ENV_VAR_BATCH   "__AFL_SHM_ID_BATCH"
+
+/* Environment variable used to pass the number of DFG nodes loaded by
+   afl-fuzz, i.e. the size of the dense map in the DFG SHM region. */
+
+#define DFG_SIZE_ENV_VAR    "__AFL_DFG_SIZE"
 
 /* Other less interesting, internal-only variables. */
 
@@ -292,6 +353,45 @@
 #define PERSIST_SIG         "##SIG_AFL_PERSISTENT##"
 #define DEFER_SIG           "##SIG_AFL_DEFER_FORKSRV##"
 
+/* In-code signature of harnesses that take test cases straight from SHM
+   (__AFL_FUZZ_TESTCASE() in afl-clang-fast). The SHM region holds the length
+   of the current test case as an u32, followed by up to MAX_FILE bytes of
+   data. */
+
+#define SHM_FUZZ_SIG        "##SIG_AFL_SHM_FUZZ##"
+#define SHM_FUZZ_SIZE       (sizeof(u32) + MAX_FILE)
+
+/* Batched execution (AFL_BATCH_SIZE) for persistent harnesses that take
+   test cases from SHM. afl-fuzz packs up to BATCH_MAX havoc test cases into
+   a separate SHM region, and the target works through them in a single
+   round-trip, without stopping in between. It stops early at the first test
+   case afl-fuzz needs a closer look at - new bits against the snapshot of
+   the virgin map, the DFG target node reached, or a DFG score above the
+   threshold - so that the maps hold the results of that test case alone.
+
+   The region starts with a header of u32 words; the runtime stamps
+   BATCH_MAGIC into it to show that it plays along. BATCH_HDR_CNT is zero
+   for regular single runs. The header is followed by the offsets and the
+   lengths of the test cases, the virgin map snapshot, and the data. */
+
+#define BATCH_MAX           64
+#define BATCH_DATA_SIZE     (4 * MAX_FILE)
+
+#define BATCH_HDR_SIZE      8
+#define BATCH_HDR_MAGIC     0
+#define BATCH_HDR_CNT       1         /* Test cases in the batch          */
+#define BATCH_HDR_CUR       2         /* Test case being run (by target)  */
+#define BATCH_HDR_TARGET    3         /* DFG index of the target node     */
+#define BATCH_HDR_DFG_MAX   4         /* Stop on DFG scores above that    */
+#define BATCH_MAGIC         0xba7c4
+
+#define BATCH_OFF(_b)       ((u32*)(_b) + BATCH_HDR_SIZE)
+#define BATCH_LEN(_b)       (BATCH_OFF(_b) + BATCH_MAX)
+#define BATCH_VIRGIN(_b)    ((u8*)(BATCH_LEN(_b) + BATCH_MAX))
+#define BATCH_DATA(_b)      (BATCH_VIRGIN(_b) + MAP_SIZE)
+#define BATCH_SHM_SIZE      (sizeof(u32) * (BATCH_HDR_SIZE + 2 * BATCH_MAX) + \
+                             MAP_SIZE + BATCH_DATA_SIZE)
+
 /* Distinctive bitmap signature used to indicate failed execution: */
 
 #define EXEC_FAIL_SIG       0xfee1dead
@@ -329,9 +429,43 @@
 
 #define MAP_SIZE_POW2       16
 #define MAP_SIZE            (1 << MAP_SIZE_POW2)
+
+/* Default number of DFG nodes. afl-fuzz sizes the DFG SHM region to the DFG
+   loaded with -p and passes that size on in DFG_SIZE_ENV_VAR; this value is
+   only used for the runtime's dummy region and when no DFG is loaded. */
+
 #define DFG_MAP_SIZE        32568
 #define MAX_PARETO_FRONT    10000
 
+/* Layout of the DFG SHM region, in u32 words: a small header, the dense
+   per-node score map, and a log of node indices in the order in which they
+   were first hit during the current run. The log lets afl-fuzz reset, score
+   and hash DFG coverage in O(nodes hit) instead of O(DFG_MAP_SIZE). The
+   runtime stamps DFG_LOG_MAGIC into the header once it maintains the log;
+   binaries built with an older pass never do, and get the dense treatment.
+   It also reports the number of nodes the binary was built with, so that
+   afl-fuzz can tell if it loaded a smaller DFG. Along with the log, the
+   runtime keeps the maximum and the sum (a u64 spanning two words) of the
+   scores of the nodes hit, i.e. the proximity score of the run. A runtime
+   in persistent mode that wipes the slots it dirtied (and the target hit
+   flag) by itself between iterations says so by stamping DFG_LOG_MAGIC into
+   DFG_HDR_SELF_RESET; afl-fuzz then leaves both regions alone. */
+
+#define DFG_HDR_SIZE        8
+#define DFG_HDR_MAGIC       0
+#define DFG_HDR_HIT_CNT     1
+#define DFG_HDR_NODE_CNT    2
+#define DFG_HDR_MAX         3
+#define DFG_HDR_SUM         4
+#define DFG_HDR_SELF_RESET  6
+#define DFG_LOG_MAGIC       0xdf6106
+#define DFG_SHM_SIZE(_n)    (sizeof(u32) * (DFG_HDR_SIZE + 2 * (_n)))
+
+/* Number of levels in the skip list that keeps the queue sorted by
+   proximity score; good for about 4^QUEUE_SKIP_LEVELS entries: */
+
+#define QUEUE_SKIP_LEVELS   12
+
 /* Maximum allocator request size (keep well under INT_MAX): */
 
 #define MAX_ALLOC           0x40000000
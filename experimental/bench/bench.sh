@@ -0,0 +1,93 @@
+#!/bin/sh
+#
+# american fuzzy lop - exec/s benchmark
+# -------------------------------------
+#
+# Runs afl-fuzz for a fixed number of execs against test-instr.c and reports
+# exec/s along with the CPU time afl-fuzz spent on its own side per exec.
+# Invoked by 'make bench' from the top-level directory; BENCH_EXECS sets the
+# number of execs per run (default: 200000).
+#
+# afl-fuzz always wants a DFG (-p), so both runs use test-instr.dfg. The first
+# one fuzzes the afl-gcc build, which leaves the DFG map empty. The second one
+# fuzzes a build from afl-clang-fast with the DFG compiled in, so that the
+# target fills in the DFG map, too; it is skipped if afl-clang-fast is not
+# around.
+#
+
+BENCH_EXECS=${BENCH_EXECS:-200000}
+BENCH_DIR=`mktemp -d /tmp/afl-bench.XXXXXX` || exit 1
+AFL_DIR=`pwd`
+
+trap 'rm -rf "$BENCH_DIR"' EXIT
+
+if [ ! -x ./afl-fuzz -o ! -x ./afl-gcc ]; then
+
+  echo "[-] Error: run 'make' first." 1>&2
+  exit 1
+
+fi
+
+mkdir "$BENCH_DIR/in"
+echo 1 >"$BENCH_DIR/in/one"
+
+unset AFL_USE_ASAN AFL_USE_MSAN
+
+AFL_QUIET=1 AFL_INST_RATIO=100 AFL_PATH=. ./afl-gcc -O3 test-instr.c \
+  -o "$BENCH_DIR/test-instr" 2>/dev/null || exit 1
+
+if [ -x ./afl-clang-fast ]; then
+
+  DAFL_DFG_SCORE=experimental/bench/test-instr.dfg AFL_QUIET=1 \
+    ./afl-clang-fast -O3 -g test-instr.c -o "$BENCH_DIR/test-instr-dfg" \
+    2>/dev/null || exit 1
+
+else
+
+  echo "[!] afl-clang-fast not found, skipping the DFG-instrumented sample."
+
+fi
+
+# run_one name binary
+
+run_one() {
+
+  NAME="$1"
+  BIN="$2"
+
+  rm -rf "$BENCH_DIR/out"
+
+  AFL_NO_UI=1 AFL_SKIP_CPUFREQ=1 AFL_I_DONT_CARE_ABOUT_MISSING_CRASHES=1 \
+  AFL_BENCH_EXECS=$BENCH_EXECS CLUDAFL="$AFL_DIR" \
+    ./afl-fuzz -i "$BENCH_DIR/in" -o "$BENCH_DIR/out" -m none \
+    -p experimental/bench/test-instr.dfg -- "$BIN" >"$BENCH_DIR/log" 2>&1
+
+  STATS="$BENCH_DIR/out/fuzzer_stats"
+
+  if [ ! -f "$STATS" ]; then
+
+    echo "[-] $NAME: afl-fuzz failed, last lines of its output:" 1>&2
+    tail -5 "$BENCH_DIR/log" 1>&2
+    exit 1
+
+  fi
+
+  awk -v name="$NAME" -F' *: *' '
+    { v[$1] = $2 }
+    END {
+      ex = v["execs_done"]; wall = v["wall_time_ms"]; cpu = v["fuzzer_cpu_ms"];
+      printf("%-12s %10u execs %10.1f exec/s %8.2f us fuzzer CPU/exec\n",
+             name, ex, wall ? ex * 1000 / wall : 0, ex ? cpu * 1000 / ex : 0);
+    }' "$STATS"
+
+}
+
+echo "[*] Running $BENCH_EXECS execs per benchmark..."
+
+run_one "test-instr" "$BENCH_DIR/test-instr"
+
+if [ -x "$BENCH_DIR/test-instr-dfg" ]; then
+  run_one "dfg-sample" "$BENCH_DIR/test-instr-dfg"
+fi
+
+exit 0
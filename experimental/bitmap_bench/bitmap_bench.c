@@ -0,0 +1,173 @@
+/*
+   american fuzzy lop - bitmap kernel micro-benchmark
+   --------------------------------------------------
+
+   Times every set of bitmap kernels from bitmap-inl.h that the CPU can run
+   against the scalar ones, on a trace with a configurable fraction of hit
+   bytes, and checks that all of them produce identical results.
+
+   Build and run from the top-level directory with:
+
+     make bench-bitmap
+     ./bitmap-bench [density_percent] [iterations]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../../config.h"
+#include "../../types.h"
+#include "../../bitmap-inl.h"
+
+static u8 trace[MAP_SIZE], virgin[MAP_SIZE], work[MAP_SIZE], ref[MAP_SIZE];
+
+
+static u64 get_cur_time_us(void) {
+
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+
+}
+
+
+/* Fill the trace so that roughly density% of the bytes are hit, with a
+   spread of hit counts; the virgin map has about half of them seen. */
+
+static void make_maps(u32 density) {
+
+  u32 i;
+
+  for (i = 0; i < MAP_SIZE; i++) {
+
+    trace[i]  = (u32)(random() % 100) < density ? 1 + random() % 255 : 0;
+    virgin[i] = (random() & 1) ? 0xff : (u8)~trace[i];
+
+  }
+
+}
+
+
+/* Run all kernels of a set, compare the results against the scalar set and
+   report ns per call. */
+
+static void bench(const struct bitmap_kernels* k, u32 iters) {
+
+  const struct bitmap_kernels* s = &bitmap_kernels_scalar;
+
+  u64 t0, t_hnb, t_cls, t_smp, t_cnt, t_255;
+  u32 i, sink = 0;
+
+  /* Correctness first. */
+
+  memcpy(work, virgin, MAP_SIZE);
+  memcpy(ref, virgin, MAP_SIZE);
+
+  if (k->has_new_bits(trace, work) != s->has_new_bits(trace, ref) ||
+      memcmp(work, ref, MAP_SIZE)) goto mismatch;
+
+  memcpy(work, trace, MAP_SIZE);
+  memcpy(ref, trace, MAP_SIZE);
+  k->classify_counts(work);
+  s->classify_counts(ref);
+  if (memcmp(work, ref, MAP_SIZE)) goto mismatch;
+
+  memcpy(work, trace, MAP_SIZE);
+  memcpy(ref, trace, MAP_SIZE);
+  k->simplify_trace(work);
+  s->simplify_trace(ref);
+  if (memcmp(work, ref, MAP_SIZE)) goto mismatch;
+
+  if (k->count_bytes(trace) != s->count_bytes(trace) ||
+      k->count_non_255_bytes(virgin) != s->count_non_255_bytes(virgin))
+    goto mismatch;
+
+  /* has_new_bits() on a map that already has everything recorded is the
+     steady-state case, so that is what gets timed. */
+
+  memcpy(work, virgin, MAP_SIZE);
+  k->has_new_bits(trace, work);
+
+  t0 = get_cur_time_us();
+  for (i = 0; i < iters; i++) sink += k->has_new_bits(trace, work);
+  t_hnb = get_cur_time_us() - t0;
+
+  t0 = get_cur_time_us();
+  for (i = 0; i < iters; i++) {
+    memcpy(work, trace, MAP_SIZE);
+    k->classify_counts(work);
+  }
+  t_cls = get_cur_time_us() - t0;
+
+  t0 = get_cur_time_us();
+  for (i = 0; i < iters; i++) {
+    memcpy(work, trace, MAP_SIZE);
+    k->simplify_trace(work);
+  }
+  t_smp = get_cur_time_us() - t0;
+
+  t0 = get_cur_time_us();
+  for (i = 0; i < iters; i++) sink += k->count_bytes(trace);
+  t_cnt = get_cur_time_us() - t0;
+
+  t0 = get_cur_time_us();
+  for (i = 0; i < iters; i++) sink += k->count_non_255_bytes(virgin);
+  t_255 = get_cur_time_us() - t0;
+
+  printf("%-8s  has_new_bits %7.0f ns  classify_counts* %7.0f ns  "
+         "simplify_trace* %7.0f ns  count_bytes %7.0f ns  "
+         "count_non_255 %7.0f ns  (%u)\n", k->name,
+         t_hnb * 1000.0 / iters, t_cls * 1000.0 / iters,
+         t_smp * 1000.0 / iters, t_cnt * 1000.0 / iters,
+         t_255 * 1000.0 / iters, sink & 1);
+
+  return;
+
+mismatch:
+
+  printf("%-8s  MISMATCH against scalar kernels!\n", k->name);
+  exit(1);
+
+}
+
+
+int main(int argc, char** argv) {
+
+  u32 density = argc > 1 ? atoi(argv[1]) : 5;
+  u32 iters   = argc > 2 ? atoi(argv[2]) : 100000;
+
+  if (density > 100 || !iters) {
+    fprintf(stderr, "Usage: %s [density_percent] [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  srandom(0x41464c);
+  init_count_class16();
+  make_maps(density);
+
+  printf("MAP_SIZE %u, %u%% of bytes hit, %u iterations "
+         "(* includes a MAP_SIZE memcpy)\n", MAP_SIZE, density, iters);
+
+  bench(&bitmap_kernels_scalar, iters);
+
+#ifdef HAVE_BITMAP_SIMD
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    bench(&bitmap_kernels_avx2, iters);
+
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    bench(&bitmap_kernels_avx512, iters);
+
+#endif /* HAVE_BITMAP_SIMD */
+
+  printf("selected: %s\n", select_bitmap_kernels()->name);
+
+  return 0;
+
+}
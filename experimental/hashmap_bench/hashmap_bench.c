@@ -0,0 +1,262 @@
+/*
+   american fuzzy lop - hash map micro-benchmark
+   ---------------------------------------------
+
+   Compares the open addressing hash map from afl-fuzz.h with the chained
+   table it replaced (kept below as chained_*), on the kind of load the
+   input-hash, DFG-hash and valuation-hash maps see: a stream of inserts of
+   32-bit hashes, each preceded by a lookup, plus lookups of keys that are
+   mostly absent. A random mix of operations is also checked against the
+   chained table first.
+
+   Build and run from the top-level directory with:
+
+     make bench-hashmap
+     ./hashmap-bench [keys] [rounds]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../../config.h"
+#include "../../types.h"
+#include "../../debug.h"
+#include "../../alloc-inl.h"
+#include "../../afl-fuzz.h"
+
+
+/* The chained table, as it was. */
+
+struct chained_pair {
+  u32 key;
+  void* value;
+  struct chained_pair* next;
+};
+
+struct chained_map {
+  u32 size;
+  u32 table_size;
+  struct chained_pair** table;
+};
+
+static struct chained_map* chained_create(u32 table_size) {
+  struct chained_map* map = ck_alloc(sizeof(struct chained_map));
+  map->table_size = table_size;
+  map->table = ck_alloc(table_size * sizeof(struct chained_pair*));
+  return map;
+}
+
+static void chained_resize(struct chained_map *map) {
+  u32 new_table_size = map->table_size * 2;
+  struct chained_pair **new_table = ck_alloc(new_table_size * sizeof(struct chained_pair*));
+  for (u32 i = 0; i < map->table_size; i++) {
+    struct chained_pair* pair = map->table[i];
+    while (pair != NULL) {
+      struct chained_pair *next = pair->next;
+      u32 index = pair->key % new_table_size;
+      pair->next = new_table[index];
+      new_table[index] = pair;
+      pair = next;
+    }
+  }
+  ck_free(map->table);
+  map->table = new_table;
+  map->table_size = new_table_size;
+}
+
+static void chained_insert(struct chained_map* map, u32 key, void* value) {
+  u32 index = key % map->table_size;
+  struct chained_pair* pair = ck_alloc(sizeof(struct chained_pair));
+  pair->key = key;
+  pair->value = value;
+  pair->next = map->table[index];
+  map->table[index] = pair;
+  map->size++;
+  if (map->size > map->table_size / 2) chained_resize(map);
+}
+
+static void chained_remove(struct chained_map *map, u32 key) {
+  u32 index = key % map->table_size;
+  struct chained_pair *pair = map->table[index], *prev = NULL;
+  while (pair != NULL) {
+    if (pair->key == key) {
+      if (!prev) map->table[index] = pair->next;
+      else prev->next = pair->next;
+      map->size--;
+      ck_free(pair);
+      return;
+    }
+    prev = pair;
+    pair = pair->next;
+  }
+}
+
+static struct chained_pair* chained_get(struct chained_map* map, u32 key) {
+  struct chained_pair* pair = map->table[key % map->table_size];
+  while (pair != NULL) {
+    if (pair->key == key) return pair;
+    pair = pair->next;
+  }
+  return NULL;
+}
+
+static void chained_free(struct chained_map* map) {
+  for (u32 i = 0; i < map->table_size; i++) {
+    struct chained_pair* pair = map->table[i];
+    while (pair != NULL) {
+      struct chained_pair* next = pair->next;
+      ck_free(pair);
+      pair = next;
+    }
+  }
+  ck_free(map->table);
+  ck_free(map);
+}
+
+
+static u64 get_cur_time_us(void) {
+
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+
+}
+
+
+static u32 rand32(void) {
+
+  return ((u32)random() << 16) ^ (u32)random();
+
+}
+
+
+/* Random inserts, removes and lookups over a small key space (so that all
+   three hit existing keys often), compared step by step. */
+
+static void check(u32 ops) {
+
+  struct hashmap* oa = hashmap_create(16);
+  struct chained_map* ch = chained_create(16);
+  u32 i;
+
+  for (i = 0; i < ops; i++) {
+
+    u32 key = rand32() % 4096, op = random() % 3;
+    struct key_value_pair* a = hashmap_get(oa, key);
+    struct chained_pair* b = chained_get(ch, key);
+
+    if (!a != !b || (a && a->value != b->value)) {
+      printf("MISMATCH on key %u after %u operations!\n", key, i);
+      exit(1);
+    }
+
+    if (op == 0 && !b) {
+      hashmap_insert(oa, key, (void*)(size_t)(i + 1));
+      chained_insert(ch, key, (void*)(size_t)(i + 1));
+    } else if (op == 1) {
+      hashmap_remove(oa, key);
+      chained_remove(ch, key);
+    }
+
+    if (hashmap_size(oa) != ch->size) {
+      printf("MISMATCH in size after %u operations!\n", i);
+      exit(1);
+    }
+
+  }
+
+  hashmap_free(oa);
+  chained_free(ch);
+
+}
+
+
+int main(int argc, char** argv) {
+
+  u32 keys   = argc > 1 ? atoi(argv[1]) : 1000000;
+  u32 rounds = argc > 2 ? atoi(argv[2]) : 3;
+  u32 *ins, *miss, i, r, sink = 0;
+  u64 t0, t_oa_ins = 0, t_oa_get = 0, t_ch_ins = 0, t_ch_get = 0;
+
+  if (!keys || !rounds) {
+    fprintf(stderr, "Usage: %s [keys] [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  srandom(0x41464c);
+  check(1000000);
+
+  ins  = ck_alloc(keys * sizeof(u32));
+  miss = ck_alloc(keys * sizeof(u32));
+
+  for (r = 0; r < rounds; r++) {
+
+    struct hashmap* oa;
+    struct chained_map* ch;
+
+    for (i = 0; i < keys; i++) {
+      ins[i]  = rand32();
+      miss[i] = rand32();
+    }
+
+    /* Same pattern as the dedup maps: look up, insert if new. Both start
+       from the 1024-slot tables that afl-fuzz uses. */
+
+    t0 = get_cur_time_us();
+    oa = hashmap_create(1024);
+    for (i = 0; i < keys; i++)
+      if (!hashmap_get(oa, ins[i])) hashmap_insert(oa, ins[i], NULL);
+    t_oa_ins += get_cur_time_us() - t0;
+
+    t0 = get_cur_time_us();
+    ch = chained_create(1024);
+    for (i = 0; i < keys; i++)
+      if (!chained_get(ch, ins[i])) chained_insert(ch, ins[i], NULL);
+    t_ch_ins += get_cur_time_us() - t0;
+
+    /* Lookups, half hits and half (probable) misses, in no particular
+       order; in insertion order, the chained table would get to walk its
+       nodes in allocation order. */
+
+    for (i = keys - 1; i > 0; i--) {
+      u32 j = rand32() % (i + 1), t = ins[i];
+      ins[i] = ins[j];
+      ins[j] = t;
+    }
+
+    t0 = get_cur_time_us();
+    for (i = 0; i < keys; i++)
+      sink += !!hashmap_get(oa, (i & 1) ? ins[i] : miss[i]);
+    t_oa_get += get_cur_time_us() - t0;
+
+    t0 = get_cur_time_us();
+    for (i = 0; i < keys; i++)
+      sink += !!chained_get(ch, (i & 1) ? ins[i] : miss[i]);
+    t_ch_get += get_cur_time_us() - t0;
+
+    if (hashmap_size(oa) != ch->size) {
+      printf("MISMATCH in size!\n");
+      return 1;
+    }
+
+    hashmap_free(oa);
+    chained_free(ch);
+
+  }
+
+  printf("%u keys, %u rounds (%u)\n", keys, rounds, sink & 1);
+  printf("open addressing  lookup+insert %6.1f ns  lookup %6.1f ns\n",
+         t_oa_ins * 1000.0 / keys / rounds, t_oa_get * 1000.0 / keys / rounds);
+  printf("chained          lookup+insert %6.1f ns  lookup %6.1f ns\n",
+         t_ch_ins * 1000.0 / keys / rounds, t_ch_get * 1000.0 / keys / rounds);
+
+  ck_free(ins);
+  ck_free(miss);
+
+  return 0;
+
+}
@@ -0,0 +1,444 @@
+/*
+   american fuzzy lop - in-process k-means for DFG vectors
+   -------------------------------------------------------
+
+   The clustering behind -s cluster, in C rather than in clustering.py:
+   k-means++ seeding, Lloyd iterations and a silhouette-based choice of k,
+   matching what the script did with sklearn. The fit runs once, on the
+   DFG vectors of the dry run; after that, a new queue entry is placed with
+   a nearest-centroid lookup against the centroids kept in struct kmeans,
+   or, with kmeans_partial_fit(), also moves them along as mini-batch
+   k-means does.
+
+   Vectors are dense rows of doubles for the fit, and the fuzzer's own u64
+   DFG arrays for kmeans_predict(). The fit draws from its own splitmix64
+   state, so it leaves the fuzzer's random() sequence alone.
+*/
+
+#ifndef _HAVE_KMEANS_INL_H
+#define _HAVE_KMEANS_INL_H
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "config.h"
+#include "types.h"
+#include "alloc-inl.h"
+
+
+struct kmeans {
+
+  u32 k;                              /* Number of clusters               */
+  u32 dim;                            /* Length of each vector            */
+  double* centroids;                  /* k rows of dim coordinates        */
+  u64* counts;                        /* Vectors each centroid has seen   */
+
+};
+
+
+static void kmeans_free(struct kmeans* km) {
+
+  if (!km) return;
+
+  ck_free(km->centroids);
+  ck_free(km->counts);
+  ck_free(km);
+
+}
+
+
+static u64 kmeans_rand(u64* state) {
+
+  u64 z = (*state += 0x9E3779B97F4A7C15ULL);
+
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+
+  return z ^ (z >> 31);
+
+}
+
+
+static double kmeans_dist2(const double* a, const double* b, u32 dim) {
+
+  double d = 0;
+  u32 i;
+
+  for (i = 0; i < dim; i++) {
+    double t = a[i] - b[i];
+    d += t * t;
+  }
+
+  return d;
+
+}
+
+
+/* Index of the centroid closest to x; its squared distance goes to *d2. */
+
+static u32 kmeans_nearest(const double* cent, u32 k, u32 dim,
+                          const double* x, double* d2) {
+
+  double best_d = DBL_MAX;
+  u32 c, best = 0;
+
+  for (c = 0; c < k; c++) {
+
+    double d = kmeans_dist2(cent + (u64)c * dim, x, dim);
+
+    if (d < best_d) {
+      best_d = d;
+      best   = c;
+    }
+
+  }
+
+  *d2 = best_d;
+  return best;
+
+}
+
+
+/* k-means++ seeding: every further centroid is a vector picked with a
+   probability proportional to its squared distance from the nearest
+   centroid so far. d2 is scratch space for n doubles. */
+
+static void kmeans_seed(double* cent, const double* pts, u32 n, u32 dim,
+                        u32 k, double* d2, u64* rng) {
+
+  u32 c, i, pick = kmeans_rand(rng) % n;
+
+  memcpy(cent, pts + (u64)pick * dim, dim * sizeof(double));
+
+  for (i = 0; i < n; i++)
+    d2[i] = kmeans_dist2(cent, pts + (u64)i * dim, dim);
+
+  for (c = 1; c < k; c++) {
+
+    double* cur = cent + (u64)c * dim;
+    double sum = 0, r;
+
+    for (i = 0; i < n; i++) sum += d2[i];
+
+    if (sum > 0) {
+
+      r = (kmeans_rand(rng) >> 11) * (1.0 / 9007199254740992.0) * sum;
+
+      /* Rounding may leave r a tad above zero at the end; pick is then the
+         last vector with a non-zero weight. */
+
+      for (i = 0; i < n; i++) {
+        if (!d2[i]) continue;
+        pick = i;
+        r -= d2[i];
+        if (r < 0) break;
+      }
+
+    } else pick = kmeans_rand(rng) % n;
+
+    memcpy(cur, pts + (u64)pick * dim, dim * sizeof(double));
+
+    for (i = 0; i < n; i++) {
+      double d = kmeans_dist2(cur, pts + (u64)i * dim, dim);
+      if (d < d2[i]) d2[i] = d;
+    }
+
+  }
+
+}
+
+
+/* Lloyd iterations from the centroids in cent until the labels settle.
+   On return, every label is the nearest centroid of its vector. A cluster
+   that runs empty is restarted on the vector farthest from its centroid.
+   Returns the inertia (sum of squared distances). */
+
+static double kmeans_lloyd(double* cent, const double* pts, u32 n, u32 dim,
+                           u32 k, u32* labels, double* d2, u32* cnt) {
+
+  double inertia = 0;
+  u32 iter, i, c, j;
+
+  for (iter = 0; iter < KMEANS_MAX_ITER; iter++) {
+
+    u32 changed = 0;
+
+    inertia = 0;
+
+    for (i = 0; i < n; i++) {
+
+      u32 l = kmeans_nearest(cent, k, dim, pts + (u64)i * dim, &d2[i]);
+
+      if (!iter || l != labels[i]) changed++;
+      labels[i] = l;
+      inertia  += d2[i];
+
+    }
+
+    if (!changed || iter == KMEANS_MAX_ITER - 1) break;
+
+    memset(cent, 0, (u64)k * dim * sizeof(double));
+    memset(cnt, 0, k * sizeof(u32));
+
+    for (i = 0; i < n; i++) {
+
+      const double* p = pts + (u64)i * dim;
+      double* s = cent + (u64)labels[i] * dim;
+
+      for (j = 0; j < dim; j++) s[j] += p[j];
+      cnt[labels[i]]++;
+
+    }
+
+    for (c = 0; c < k; c++) {
+
+      double* s = cent + (u64)c * dim;
+
+      if (cnt[c]) {
+
+        for (j = 0; j < dim; j++) s[j] /= cnt[c];
+
+      } else {
+
+        u32 far = 0;
+
+        for (i = 1; i < n; i++)
+          if (d2[i] > d2[far]) far = i;
+
+        memcpy(s, pts + (u64)far * dim, dim * sizeof(double));
+        d2[far] = 0;
+
+      }
+
+    }
+
+  }
+
+  return inertia;
+
+}
+
+
+/* Fit k clusters (k <= n), keeping the best of KMEANS_RESTARTS seedings by
+   inertia. labels gets the cluster of each of the n vectors. */
+
+static struct kmeans* kmeans_fit(const double* pts, u32 n, u32 dim, u32 k,
+                                 u32* labels, u64* rng) {
+
+  struct kmeans* km = ck_alloc(sizeof(struct kmeans));
+
+  double* cent = ck_alloc((u64)k * dim * sizeof(double));
+  double* d2   = ck_alloc(n * sizeof(double));
+  u32*    lab  = ck_alloc(n * sizeof(u32));
+  u32*    cnt  = ck_alloc(k * sizeof(u32));
+
+  double best = DBL_MAX;
+  u32 r;
+
+  km->k         = k;
+  km->dim       = dim;
+  km->centroids = ck_alloc((u64)k * dim * sizeof(double));
+  km->counts    = ck_alloc(k * sizeof(u64));
+
+  for (r = 0; r < KMEANS_RESTARTS; r++) {
+
+    double inertia;
+
+    kmeans_seed(cent, pts, n, dim, k, d2, rng);
+    inertia = kmeans_lloyd(cent, pts, n, dim, k, lab, d2, cnt);
+
+    if (inertia < best) {
+      best = inertia;
+      memcpy(km->centroids, cent, (u64)k * dim * sizeof(double));
+      memcpy(labels, lab, n * sizeof(u32));
+    }
+
+  }
+
+  for (r = 0; r < n; r++) km->counts[labels[r]]++;
+
+  ck_free(cent);
+  ck_free(d2);
+  ck_free(lab);
+  ck_free(cnt);
+
+  return km;
+
+}
+
+
+/* Mean silhouette coefficient of a labelling of m vectors, given the m x m
+   matrix of their pairwise distances. Vectors alone in their cluster
+   count as 0, like in sklearn. Needs two non-empty clusters, -1 if not. */
+
+static double kmeans_silhouette(const double* dist, u32 m, const u32* lab,
+                                u32 k) {
+
+  double* sum = ck_alloc(k * sizeof(double));
+  u32*    cnt = ck_alloc(k * sizeof(u32));
+
+  double total = 0;
+  u32 i, j, c, used = 0;
+
+  for (i = 0; i < m; i++)
+    if (!cnt[lab[i]]++) used++;
+
+  if (used < 2) {
+    total = -(double)m;
+    goto out;
+  }
+
+  for (i = 0; i < m; i++) {
+
+    const double* row = dist + (u64)i * m;
+    double a, b = DBL_MAX;
+    u32 own = lab[i];
+
+    if (cnt[own] == 1) continue;
+
+    memset(sum, 0, k * sizeof(double));
+    for (j = 0; j < m; j++) sum[lab[j]] += row[j];
+
+    a = sum[own] / (cnt[own] - 1);
+
+    for (c = 0; c < k; c++)
+      if (c != own && cnt[c] && sum[c] / cnt[c] < b) b = sum[c] / cnt[c];
+
+    if (MAX(a, b) > 0) total += (b - a) / MAX(a, b);
+
+  }
+
+out:
+
+  ck_free(sum);
+  ck_free(cnt);
+
+  return total / m;
+
+}
+
+
+/* Fit n vectors, trying every k in [KMEANS_K_MIN, KMEANS_K_MAX] that fits
+   below n and keeping the one with the best silhouette score, the way
+   clustering.py picked it. The score is taken on a random sample of at
+   most KMEANS_SIL_SAMPLE vectors, as it is quadratic in their number.
+   labels gets the cluster of each vector. */
+
+static struct kmeans* kmeans_fit_auto(const double* pts, u32 n, u32 dim,
+                                      u32* labels, u64 seed) {
+
+  struct kmeans* best_km = NULL;
+  double best_score = -2, *dist;
+  u32 *idx, *lab, *s_lab, m, i, j, k, k_max = MIN(KMEANS_K_MAX, n - 1);
+  u64 rng = seed;
+
+  /* Too few vectors for a silhouette score; one cluster each. */
+
+  if (k_max < KMEANS_K_MIN)
+    return kmeans_fit(pts, n, dim, MIN(n, KMEANS_K_MIN), labels, &rng);
+
+  m     = MIN(n, KMEANS_SIL_SAMPLE);
+  idx   = ck_alloc(n * sizeof(u32));
+  lab   = ck_alloc(n * sizeof(u32));
+  s_lab = ck_alloc(m * sizeof(u32));
+  dist  = ck_alloc((u64)m * m * sizeof(double));
+
+  for (i = 0; i < n; i++) idx[i] = i;
+
+  for (i = 0; i < m; i++) {
+    u32 r = i + kmeans_rand(&rng) % (n - i), t = idx[i];
+    idx[i] = idx[r];
+    idx[r] = t;
+  }
+
+  for (i = 0; i < m; i++)
+    for (j = i + 1; j < m; j++)
+      dist[(u64)i * m + j] = dist[(u64)j * m + i] =
+        sqrt(kmeans_dist2(pts + (u64)idx[i] * dim, pts + (u64)idx[j] * dim,
+                          dim));
+
+  for (k = KMEANS_K_MIN; k <= k_max; k++) {
+
+    struct kmeans* km = kmeans_fit(pts, n, dim, k, lab, &rng);
+    double score;
+
+    for (i = 0; i < m; i++) s_lab[i] = lab[idx[i]];
+    score = kmeans_silhouette(dist, m, s_lab, k);
+
+    if (score > best_score) {
+
+      kmeans_free(best_km);
+      best_km    = km;
+      best_score = score;
+      memcpy(labels, lab, n * sizeof(u32));
+
+    } else kmeans_free(km);
+
+  }
+
+  ck_free(idx);
+  ck_free(lab);
+  ck_free(s_lab);
+  ck_free(dist);
+
+  return best_km;
+
+}
+
+
+/* Cluster of a DFG vector of km->dim counters. */
+
+static u32 kmeans_predict(const struct kmeans* km, const u64* vec) {
+
+  double best_d = DBL_MAX;
+  u32 c, i, best = 0;
+
+  for (c = 0; c < km->k; c++) {
+
+    const double* cent = km->centroids + (u64)c * km->dim;
+    double d = 0;
+
+    for (i = 0; i < km->dim; i++) {
+      double t = cent[i] - (double)vec[i];
+      d += t * t;
+    }
+
+    if (d < best_d) {
+      best_d = d;
+      best   = c;
+    }
+
+  }
+
+  return best;
+
+}
+
+
+/* Mini-batch k-means step (Sculley, 2010) for n new vectors: label them
+   all against the current centroids, then pull each one's centroid toward
+   it by 1 / (vectors that centroid has seen so far). The step size shrinks
+   as a cluster grows, so the centroids settle where most vectors are
+   rather than where the fit started. labels gets the cluster of each. */
+
+static void kmeans_partial_fit(struct kmeans* km, const u64** vecs, u32 n,
+                               u32* labels) {
+
+  u32 i, j;
+
+  for (i = 0; i < n; i++) labels[i] = kmeans_predict(km, vecs[i]);
+
+  for (i = 0; i < n; i++) {
+
+    double* cent = km->centroids + (u64)labels[i] * km->dim;
+    double eta = 1.0 / ++km->counts[labels[i]];
+
+    for (j = 0; j < km->dim; j++)
+      cent[j] += eta * ((double)vecs[i][j] - cent[j]);
+
+  }
+
+}
+
+#endif /* !_HAVE_KMEANS_INL_H */
@@ -272,6 +272,21 @@ static void edit_params(u32 argc, char** argv) {
 #endif /* ^__APPLE__ */
     "_I(); } while (0)";
 
+  /* Same trick for harnesses that want their test cases straight from SHM.
+     __AFL_FUZZ_TESTCASE(&len) returns the data and stores its length. */
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE(_A)="
+    "({ static volatile char *_S __attribute__((used)); "
+    " _S = (char*)\"" SHM_FUZZ_SIG "\"; "
+#ifdef __APPLE__
+    "__attribute__((visibility(\"default\"))) "
+    "unsigned char *_T(unsigned int *) __asm__(\"___afl_fuzz_testcase\"); "
+#else
+    "__attribute__((visibility(\"default\"))) "
+    "unsigned char *_T(unsigned int *) __asm__(\"__afl_fuzz_testcase\"); "
+#endif /* ^__APPLE__ */
+    "_T(_A); })";
+
   if (x_set) {
     cc_params[cc_par_cnt++] = "-x";
     cc_params[cc_par_cnt++] = "none";
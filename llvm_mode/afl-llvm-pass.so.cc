@@ -38,6 +38,8 @@
 #include <fstream>
 #include <sstream>
 #include <set>
+#include <tuple>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -46,9 +48,11 @@
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
 #include "llvm/Support/CommandLine.h"
 
@@ -60,6 +64,7 @@ bool no_filename_match = false;
 std::set<std::string> instr_targets;
 std::map<std::string,std::pair<unsigned int,unsigned int>> dfg_node_map;
 unsigned int max_score = 0;
+unsigned int dfg_node_cnt = 0;
 std::string target_info;
 
 
@@ -112,13 +117,10 @@ void initDFGNodeMap(char* dfg_file) {
       max_score = dafl_score;
       target_info = targ_line;
     }
-
-    if (idx >= DFG_MAP_SIZE) {
-      std::cout << "Input DFG is too large (check DFG_MAP_SIZE)" << std::endl;
-      exit(1);
-    }
   }
 
+  dfg_node_cnt = idx;
+
   OKF("Target node: %s with score %d", target_info.c_str(), max_score);
 }
 
@@ -172,6 +174,20 @@ bool AFLCoverage::runOnModule(Module &M) {
       M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc",
       0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
 
+  /* First hit of a DFG node in a run is reported to the runtime, which keeps
+     the log of touched nodes (see __afl_dfg_hit() in afl-llvm-rt.o.c). */
+
+  FunctionCallee AFLDFGHit = M.getOrInsertFunction(
+      "__afl_dfg_hit", Type::getVoidTy(C), Int32Ty, Int32Ty);
+
+  /* Let the runtime know how large a DFG region we need. There is no fixed
+     cap anymore: afl-fuzz sizes the region to the DFG it was given. */
+
+  if (dfg_scoring)
+    new GlobalVariable(M, Int32Ty, true, GlobalValue::WeakAnyLinkage,
+                       ConstantInt::get(Int32Ty, dfg_node_cnt),
+                       "__afl_dfg_node_cnt");
+
   /* Instrument all the things! */
 
   int inst_blocks = 0;
@@ -180,7 +196,12 @@ bool AFLCoverage::runOnModule(Module &M) {
   std::string file_name = M.getSourceFileName();
   std::set<std::string> covered_targets;
 
-  
+  /* DFG nodes are instrumented in a second sweep, since the check for the
+     first hit splits the block, and we don't want to instrument the split-off
+     blocks while still iterating over the function. */
+
+  std::vector<std::tuple<Instruction *, unsigned int, unsigned int>> dfg_sites;
+
 
   for (auto &F : M) {
 
@@ -323,19 +344,38 @@ bool AFLCoverage::runOnModule(Module &M) {
           IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> 1), AFLPrevLoc);
       Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
 
-      if (is_dfg_node) {
-        /* Update DFG coverage map. */
-        LoadInst *DFGMap = IRB.CreateLoad(AFLMapDFGPtr);
-        DFGMap->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-        ConstantInt * Idx = ConstantInt::get(Int32Ty, node_idx);
-        ConstantInt * Score = ConstantInt::get(Int32Ty, node_score);
-        Value *DFGMapPtrIdx = IRB.CreateGEP(DFGMap, Idx);
-        IRB.CreateStore(Score, DFGMapPtrIdx)
-            ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-      }
+      /* A zero score would leave the slot looking unhit, so there is
+         nothing worth recording for such nodes. */
+
+      if (is_dfg_node && node_score)
+        dfg_sites.push_back(std::make_tuple(&(*IP), node_idx, node_score));
     }
   }
 
+  /* Update DFG coverage map: if (!dfg[idx]) __afl_dfg_hit(idx, score). */
+
+  MDNode *Unlikely = MDBuilder(C).createBranchWeights(1, 1000);
+
+  for (auto &site : dfg_sites) {
+    Instruction *IP = std::get<0>(site);
+    IRBuilder<> IRB(IP);
+
+    LoadInst *DFGMap = IRB.CreateLoad(AFLMapDFGPtr);
+    DFGMap->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    ConstantInt * Idx = ConstantInt::get(Int32Ty, std::get<1>(site));
+    ConstantInt * Score = ConstantInt::get(Int32Ty, std::get<2>(site));
+    Value *DFGMapPtrIdx = IRB.CreateGEP(DFGMap, Idx);
+    LoadInst *Old = IRB.CreateLoad(DFGMapPtrIdx);
+    Old->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    Value *IsFirstHit = IRB.CreateICmpEQ(Old, ConstantInt::get(Int32Ty, 0));
+
+    Instruction *ThenTerm =
+        SplitBlockAndInsertIfThen(IsFirstHit, IP, false, Unlikely);
+    IRBuilder<> ThenIRB(ThenTerm);
+    ThenIRB.CreateCall(AFLDFGHit, {Idx, Score})
+        ->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+  }
+
   /* Say something nice. */
   for (auto it = covered_targets.begin(); it != covered_targets.end(); ++it)
     std::cout << "Covered " << (*it) << std::endl;
@@ -63,24 +63,93 @@ u8* __afl_area_ptr = __afl_area_initial;
 u8 __afl_area_target_hit[1];
 u8* __afl_area_target_hit_ptr = __afl_area_target_hit;
 
-u32  __afl_area_initial_dfg[DFG_MAP_SIZE];
-u32* __afl_area_dfg_ptr = __afl_area_initial_dfg;
+u32  __afl_area_initial_dfg[DFG_HDR_SIZE + 2 * DFG_MAP_SIZE];
+u32* __afl_dfg_hdr_ptr  = __afl_area_initial_dfg;
+u32* __afl_area_dfg_ptr = __afl_area_initial_dfg + DFG_HDR_SIZE;
+u32* __afl_dfg_log_ptr  = __afl_area_initial_dfg + DFG_HDR_SIZE + DFG_MAP_SIZE;
 
 __thread u32 __afl_prev_loc;
 
+/* Test case delivered by afl-fuzz over SHM, if the harness asked for that.
+   __afl_fuzz_ptr stays NULL otherwise; see __afl_fuzz_testcase(). */
+
+u8*  __afl_fuzz_ptr;
+u32  __afl_fuzz_len_initial;
+u32* __afl_fuzz_len = &__afl_fuzz_len_initial;
+
+/* Batch region (see BATCH_MAX in config.h), and the single test case slot
+   to go back to once a batch is done. */
+
+static u32* __afl_batch;
+static u8*  __afl_fuzz_single_ptr;
+static u32* __afl_fuzz_single_len;
+
+/* Number of DFG nodes the binary was built with. The pass emits it as a weak
+   symbol into every module instrumented with a DFG; it is absent otherwise. */
+
+extern u32 __afl_dfg_node_cnt __attribute__((weak));
+
+/* Current DFG region (SHM or dummy) and its size in nodes. The dummy region
+   is swapped for a larger one if the binary was built with a big DFG. */
+
+static u32  __afl_dfg_size = DFG_MAP_SIZE;
+
+static u32* __afl_dfg_initial      = __afl_area_initial_dfg;
+static u32  __afl_dfg_initial_size = DFG_MAP_SIZE;
+
 
 /* Running in persistent mode? */
 
 static u8 is_persistent;
 
 
+/* Point the DFG globals used by the instrumentation at a region laid out as
+   described next to DFG_HDR_SIZE in config.h. */
+
+static void __afl_set_dfg_area(u32* base, u32 size) {
+
+  __afl_dfg_hdr_ptr  = base;
+  __afl_area_dfg_ptr = base + DFG_HDR_SIZE;
+  __afl_dfg_log_ptr  = base + DFG_HDR_SIZE + size;
+  __afl_dfg_size     = size;
+
+}
+
+
+/* Make sure the dummy DFG region can hold every node of the DFG the binary
+   was built with. This runs from the earliest constructor, before anything
+   instrumented gets a chance to touch the region. */
+
+static void __afl_init_dfg_area(void) {
+
+  u32 node_cnt = &__afl_dfg_node_cnt ? __afl_dfg_node_cnt : 0;
+  u32* area;
+
+  if (node_cnt <= DFG_MAP_SIZE) return;
+
+  area = mmap(NULL, DFG_SHM_SIZE(node_cnt), PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (area == MAP_FAILED) _exit(1);
+
+  __afl_dfg_initial      = area;
+  __afl_dfg_initial_size = node_cnt;
+
+  __afl_set_dfg_area(area, node_cnt);
+
+}
+
+
 /* SHM setup. */
 
 static void __afl_map_shm(void) {
 
   u8 *id_str = getenv(SHM_ENV_VAR);
   u8 *id_str_dfg = getenv(SHM_ENV_VAR_DFG);
+  u8 *id_str_dfg_size = getenv(DFG_SIZE_ENV_VAR);
   u8 *id_str_hit = getenv(SHM_ENV_VAR_HIT);
+  u8 *id_str_fuzz = getenv(SHM_ENV_VAR_FUZZ);
+  u8 *id_str_batch = getenv(SHM_ENV_VAR_BATCH);
 
   /* If we're running under AFL, attach to the appropriate region, replacing the
      early-stage __afl_area_initial region that is needed to allow some really
@@ -89,18 +158,75 @@ static void __afl_map_shm(void) {
   if (id_str) {
 
     u32 shm_id = atoi(id_str);
-    u32 shm_id_dfg = atoi(id_str_dfg);
-    u32 shm_id_hit = atoi(id_str_hit);
 
     __afl_area_ptr = shmat(shm_id, NULL, 0);
-    __afl_area_dfg_ptr = shmat(shm_id_dfg, NULL, 0);
-    __afl_area_target_hit_ptr = shmat(shm_id_hit, NULL, 0);
 
     /* Whooooops. */
 
     if (__afl_area_ptr == (void *)-1) _exit(1);
-    if (__afl_area_dfg_ptr == (void *)-1) _exit(1);
-    if (__afl_area_target_hit_ptr == (void *)-1) _exit(1);
+
+    /* Other AFL tools (afl-showmap, afl-tmin, ...) only hand out the
+       coverage map; the DFG and target hit regions stay on the dummies. */
+
+    if (id_str_hit) {
+
+      __afl_area_target_hit_ptr = shmat(atoi(id_str_hit), NULL, 0);
+      if (__afl_area_target_hit_ptr == (void *)-1) _exit(1);
+
+    }
+
+    if (id_str_dfg) {
+
+      u32  dfg_size = id_str_dfg_size ? atoi(id_str_dfg_size) : DFG_MAP_SIZE;
+      u32  node_cnt = &__afl_dfg_node_cnt ? __afl_dfg_node_cnt : 0;
+      u32* dfg_area = shmat(atoi(id_str_dfg), NULL, 0);
+
+      if (dfg_area == (void *)-1) _exit(1);
+
+      /* Tell the parent how many nodes we need. If it loaded a smaller DFG
+         than the one we were built with, it bails out after the handshake;
+         until then, we keep writing to the dummy region. */
+
+      dfg_area[DFG_HDR_NODE_CNT] = node_cnt;
+
+      if (node_cnt <= dfg_size) __afl_set_dfg_area(dfg_area, dfg_size);
+
+      /* In persistent mode, we clean up after ourselves between iterations
+         (see __afl_persistent_loop()), so the parent need not. This also
+         needs the target hit flag in SHM, or there is nothing to clean. */
+
+      if (is_persistent && id_str_hit && node_cnt <= dfg_size)
+        dfg_area[DFG_HDR_SELF_RESET] = DFG_LOG_MAGIC;
+
+    }
+
+    /* afl-fuzz only sets up the test case region for harnesses that use
+       __AFL_FUZZ_TESTCASE(). */
+
+    if (id_str_fuzz) {
+
+      u8* fuzz_area = shmat(atoi(id_str_fuzz), NULL, 0);
+
+      if (fuzz_area == (void *)-1) _exit(1);
+
+      __afl_fuzz_len = (u32*)fuzz_area;
+      __afl_fuzz_ptr = fuzz_area + sizeof(u32);
+
+      __afl_fuzz_single_len = __afl_fuzz_len;
+      __afl_fuzz_single_ptr = __afl_fuzz_ptr;
+
+      /* Batches only make sense in persistent mode. */
+
+      if (id_str_batch && is_persistent) {
+
+        __afl_batch = shmat(atoi(id_str_batch), NULL, 0);
+        if (__afl_batch == (void *)-1) _exit(1);
+
+        __afl_batch[BATCH_HDR_MAGIC] = BATCH_MAGIC;
+
+      }
+
+    }
 
     /* Write something into the bitmap so that even with low AFL_INST_RATIO,
        our parent doesn't give up on us. */
@@ -112,6 +238,209 @@ static void __afl_map_shm(void) {
 }
 
 
+/* Wipe what the previous persistent mode iteration left in the DFG and
+   target hit regions. The hit log doubles as the list of dirtied slots; if
+   it overflowed, the whole dense map gets cleared instead. */
+
+static void __afl_reset_dfg_area(void) {
+
+  u32 cnt = __afl_dfg_hdr_ptr[DFG_HDR_HIT_CNT];
+
+  if (cnt <= __afl_dfg_size) {
+
+    u32 i;
+
+    for (i = 0; i < cnt; i++)
+      __afl_area_dfg_ptr[__afl_dfg_log_ptr[i]] = 0;
+
+  } else memset(__afl_area_dfg_ptr, 0, sizeof(u32) * __afl_dfg_size);
+
+  __afl_dfg_hdr_ptr[DFG_HDR_HIT_CNT] = 0;
+  __afl_dfg_hdr_ptr[DFG_HDR_MAX] = 0;
+  *(u64*)(__afl_dfg_hdr_ptr + DFG_HDR_SUM) = 0;
+
+  __afl_area_target_hit_ptr[0] = 0;
+
+}
+
+
+/* Called by the instrumentation the first time a DFG node is hit in a run
+   (i.e., while its slot in the dense map is still zero). Appends the node to
+   the hit log before recording its score, so that a run killed in between
+   never leaves a dense entry that afl-fuzz does not know about. The running
+   sum and maximum of the scores spare afl-fuzz from scanning for them.
+
+   Threads of the target may race here. Log slots are handed out with an
+   atomic add, so each thread gets its own; the dense slot is claimed with a
+   compare-and-swap, and only the thread that wins it adds the score to the
+   sum and the maximum. A loser still leaves its node in the log: taking
+   the log slot after the dense one would open a window in which a killed
+   run leaves a dense entry that never gets cleared. afl-fuzz copes with
+   the duplicates - clearing a node twice does no harm, and
+   hash_dfg_bits() hashes each node once. If they make the log overflow,
+   the hit count still goes up and afl-fuzz falls back to the dense map. */
+
+void __afl_dfg_hit(u32 idx, u32 score) {
+
+  u32 cnt = __atomic_fetch_add(&__afl_dfg_hdr_ptr[DFG_HDR_HIT_CNT], 1,
+                               __ATOMIC_RELAXED);
+  u32 zero = 0, max;
+
+  if (cnt < __afl_dfg_size) __afl_dfg_log_ptr[cnt] = idx;
+
+  __afl_dfg_hdr_ptr[DFG_HDR_MAGIC] = DFG_LOG_MAGIC;
+
+  /* Release, so that the log entry above lands before the dense slot. */
+
+  if (!__atomic_compare_exchange_n(&__afl_area_dfg_ptr[idx], &zero, score, 0,
+                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    return;
+
+  __atomic_fetch_add((u64*)(__afl_dfg_hdr_ptr + DFG_HDR_SUM), (u64)score,
+                     __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&__afl_dfg_hdr_ptr[DFG_HDR_MAX], __ATOMIC_RELAXED);
+
+  while (score > max &&
+         !__atomic_compare_exchange_n(&__afl_dfg_hdr_ptr[DFG_HDR_MAX], &max,
+                                      score, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED));
+
+}
+
+
+/* Return the current test case and store its length in *len. This is what
+   __AFL_FUZZ_TESTCASE() calls. Under afl-fuzz, the data is read in place from
+   SHM; otherwise (say, when reproducing a crash), it comes from stdin, read
+   into a buffer that is reused across calls. */
+
+u8* __afl_fuzz_testcase(u32* len) {
+
+  static u8* buf;
+  s32 ret;
+
+  if (__afl_fuzz_ptr) {
+
+    *len = *__afl_fuzz_len;
+    return __afl_fuzz_ptr;
+
+  }
+
+  if (!buf && !(buf = malloc(MAX_FILE))) abort();
+
+  ret = read(0, buf, MAX_FILE);
+
+  *len = ret < 0 ? 0 : ret;
+  return buf;
+
+}
+
+
+/* Point __afl_fuzz_ptr at test case no. cur of the batch. */
+
+static void __afl_batch_select(u32 cur) {
+
+  __afl_batch[BATCH_HDR_CUR] = cur;
+
+  __afl_fuzz_ptr = BATCH_DATA(__afl_batch) + BATCH_OFF(__afl_batch)[cur];
+  __afl_fuzz_len = BATCH_LEN(__afl_batch) + cur;
+
+}
+
+
+/* Called at the start of every persistent mode round-trip: pick the first
+   test case of the batch afl-fuzz handed us, or the single one. */
+
+static void __afl_batch_begin(void) {
+
+  if (!__afl_batch) return;
+
+  if (__afl_batch[BATCH_HDR_CNT]) {
+
+    __afl_batch_select(0);
+
+  } else {
+
+    __afl_fuzz_ptr = __afl_fuzz_single_ptr;
+    __afl_fuzz_len = __afl_fuzz_single_len;
+
+  }
+
+}
+
+
+/* Does afl-fuzz need to see the results of the test case that just ran?
+   Mirrors what save_if_interesting() looks at for a normal exit: new bits
+   in the virgin map (with hit counts classified the same way), the DFG
+   target node, and the maximum DFG score. */
+
+static u8 __afl_batch_wants_parent(void) {
+
+  static const u8 count_class_lookup8[256] = {
+
+    [0]           = 0,
+    [1]           = 1,
+    [2]           = 2,
+    [3]           = 4,
+    [4 ... 7]     = 8,
+    [8 ... 15]    = 16,
+    [16 ... 31]   = 32,
+    [32 ... 127]  = 64,
+    [128 ... 255] = 128
+
+  };
+
+  u32* cur    = (u32*)__afl_area_ptr;
+  u8*  virgin = BATCH_VIRGIN(__afl_batch);
+  u32  target = __afl_batch[BATCH_HDR_TARGET];
+  u32  i, j;
+
+  if (target < __afl_dfg_size && __afl_area_dfg_ptr[target]) return 1;
+
+  if (__afl_dfg_hdr_ptr[DFG_HDR_MAX] > __afl_batch[BATCH_HDR_DFG_MAX])
+    return 1;
+
+  for (i = 0; i < (MAP_SIZE >> 2); i++) {
+
+    if (!cur[i]) continue;
+
+    for (j = i << 2; j < (i << 2) + 4; j++)
+      if (count_class_lookup8[__afl_area_ptr[j]] & virgin[j]) return 1;
+
+  }
+
+  return 0;
+
+}
+
+
+/* Move on to the next test case of the batch without bothering afl-fuzz,
+   if there is one and afl-fuzz has no use for the results of the current
+   one. Returns 1 if we did. */
+
+static u8 __afl_batch_next(void) {
+
+  u32 cur;
+
+  if (!__afl_batch || !__afl_batch[BATCH_HDR_CNT]) return 0;
+
+  cur = __afl_batch[BATCH_HDR_CUR];
+
+  if (cur + 1 >= __afl_batch[BATCH_HDR_CNT] || __afl_batch_wants_parent())
+    return 0;
+
+  memset(__afl_area_ptr, 0, MAP_SIZE);
+  __afl_reset_dfg_area();
+  __afl_batch_select(cur + 1);
+
+  __afl_area_ptr[0] = 1;
+  __afl_prev_loc = 0;
+
+  return 1;
+
+}
+
+
 /* Fork server logic. */
 
 static void __afl_start_forkserver(void) {
@@ -210,9 +539,13 @@ int __afl_persistent_loop(unsigned int max_cnt) {
     if (is_persistent) {
 
       memset(__afl_area_ptr, 0, MAP_SIZE);
-      memset(__afl_area_dfg_ptr, 0, sizeof(u32) * DFG_MAP_SIZE);
+      memset(__afl_area_dfg_ptr, 0, sizeof(u32) * __afl_dfg_size);
+      __afl_dfg_hdr_ptr[DFG_HDR_HIT_CNT] = 0;
+      __afl_dfg_hdr_ptr[DFG_HDR_MAX] = 0;
+      *(u64*)(__afl_dfg_hdr_ptr + DFG_HDR_SUM) = 0;
       memset(__afl_area_target_hit_ptr, 0, sizeof(u8));
       __afl_area_ptr[0] = 1;
+      __afl_batch_begin();
     }
 
     cycle_cnt  = max_cnt;
@@ -225,8 +558,20 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
     if (--cycle_cnt) {
 
+      /* Within a batch, we only stop once afl-fuzz needs to look at the
+         results, or when we run out of test cases. */
+
+      if (__afl_batch_next()) return 1;
+
       raise(SIGSTOP);
 
+      /* The parent is done with the results of the previous iteration by the
+         time it resumes us, so this is the point to wipe the DFG slots that
+         iteration dirtied. Doing it before stopping would lose the data. */
+
+      __afl_reset_dfg_area();
+      __afl_batch_begin();
+
       __afl_area_ptr[0] = 1;
       __afl_prev_loc = 0;
 
@@ -239,7 +584,7 @@ int __afl_persistent_loop(unsigned int max_cnt) {
          dummy output region. */
 
       __afl_area_ptr = __afl_area_initial;
-      __afl_area_dfg_ptr = __afl_area_initial_dfg;
+      __afl_set_dfg_area(__afl_dfg_initial, __afl_dfg_initial_size);
 
     }
 
@@ -274,6 +619,8 @@ __attribute__((constructor(CONST_PRIO))) void __afl_auto_init(void) {
 
   is_persistent = !!getenv(PERSIST_ENV_VAR);
 
+  __afl_init_dfg_area();
+
   if (getenv(DEFER_ENV_VAR)) return;
 
   __afl_manual_init();